@@ -0,0 +1,191 @@
+#include "AccessRanges.hpp"
+
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include <string.h>
+
+bool AccessRangeFinder::enabled() {
+    const char * val = ::getenv("DIN_ACCESS_RANGES");
+    return (val != 0) && (strcmp(val, "") != 0) && (strcmp(val, "0") != 0);
+}
+
+/*
+ * The loop must leave through a single edge, from a block that runs in
+ * every iteration, so that the loop exit is where all of its accesses
+ * have happened. getExitBlock() must be able to give that edge a block
+ * of its own: an access is only covered if its range event is sure to
+ * be logged.
+ */
+bool AccessRangeFinder::findExit(Loop *l, BasicBlock *&exiting, unsigned &exitIdx) {
+    exiting = l->getExitingBlock();
+    if (exiting == NULL) {
+        return false;
+    }
+
+    TerminatorInst *ti = exiting->getTerminator();
+    if (!isa<BranchInst>(ti) && !isa<SwitchInst>(ti)) {
+        return false;
+    }
+
+    int exits = 0;
+    for (unsigned i = 0; i < ti->getNumSuccessors(); i++) {
+        if (!l->contains(ti->getSuccessor(i))) {
+            exitIdx = i;
+            exits++;
+        }
+    }
+    if (exits != 1) {
+        return false;
+    }
+
+    BasicBlock *exit = ti->getSuccessor(exitIdx);
+    if (exit->getSinglePredecessor() == exiting) {
+        return true;
+    }
+    return !exit->isLandingPad() && isCriticalEdge(ti, exitIdx);
+}
+
+void AccessRangeFinder::analyzeLoop(Loop *l, ScalarEvolution &se, LoopInfo &li,
+        DominatorTree &dt) {
+    for (Loop *sub : *l) {
+        analyzeLoop(sub, se, li, dt);
+    }
+
+    BasicBlock *exiting;
+    unsigned exitIdx;
+    BasicBlock *latch = l->getLoopLatch();
+    BasicBlock *pred = l->getLoopPredecessor();
+    if (latch == NULL || pred == NULL || !findExit(l, exiting, exitIdx) ||
+        !dt.dominates(exiting, latch)) {
+        return;
+    }
+
+    const SCEV *btc = se.getBackedgeTakenCount(l);
+    if (isa<SCEVCouldNotCompute>(btc)) {
+        return;
+    }
+
+    Function *f = latch->getParent();
+    DataLayout dl(f->getParent());
+    Type *i64 = Type::getInt64Ty(f->getContext());
+    Instruction *insertPt = pred->getTerminator();
+    SCEVExpander expander(se, "dinamite.range");
+
+    for (BasicBlock *b : l->getBlocks()) {
+        if (li.getLoopFor(b) != l) {
+            continue;
+        }
+
+        /* Blocks up to the exit test run backedge-taken-count + 1
+         * times, blocks after it (up to the latch) one time less. */
+        bool beforeExit = dt.dominates(b, exiting);
+        if (!beforeExit &&
+            !(dt.dominates(exiting, b) && dt.dominates(b, latch))) {
+            continue;
+        }
+
+        for (Instruction &i : *b) {
+            Value *ptr;
+            Type *accessedType;
+            char accessType;
+
+            if (LoadInst *ld = dyn_cast<LoadInst>(&i)) {
+                if (!ld->isSimple()) continue;
+                ptr = ld->getPointerOperand();
+                accessedType = ld->getType();
+                accessType = 'r';
+            } else if (StoreInst *st = dyn_cast<StoreInst>(&i)) {
+                if (!st->isSimple()) continue;
+                ptr = st->getPointerOperand();
+                accessedType = st->getValueOperand()->getType();
+                accessType = 'w';
+            } else {
+                continue;
+            }
+
+            const SCEVAddRecExpr *ar = dyn_cast<SCEVAddRecExpr>(se.getSCEV(ptr));
+            if (ar == NULL || ar->getLoop() != l || !ar->isAffine()) {
+                continue;
+            }
+
+            const SCEV *start = ar->getStart();
+            const SCEV *stride = se.getTruncateOrSignExtend(
+                    ar->getStepRecurrence(se), i64);
+            const SCEV *count = se.getTruncateOrZeroExtend(btc, i64);
+            if (beforeExit) {
+                count = se.getAddExpr(count, se.getConstant(i64, 1));
+            }
+            if (!isSafeToExpand(start, se) || !isSafeToExpand(stride, se) ||
+                !isSafeToExpand(count, se)) {
+                continue;
+            }
+
+            AccessRange r;
+            r.access = &i;
+            r.accessType = accessType;
+            r.base = expander.expandCodeFor(start, ptr->getType(), insertPt);
+            r.stride = expander.expandCodeFor(stride, i64, insertPt);
+            r.count = expander.expandCodeFor(count, i64, insertPt);
+            r.size = dl.getTypeStoreSize(accessedType);
+            r.exiting = exiting;
+            r.exitIdx = exitIdx;
+
+            ranges.push_back(r);
+            covered.insert(&i);
+        }
+    }
+}
+
+/*
+ * Only looks at f and adds the code computing the ranges in front of
+ * the loops; the CFG is left alone until getExitBlock(), so that the
+ * analyses stay valid while this runs.
+ */
+size_t AccessRangeFinder::analyzeFunction(Function &f, ScalarEvolution &se,
+        LoopInfo &li) {
+    ranges.clear();
+    covered.clear();
+
+    if (f.empty()) {
+        return 0;
+    }
+
+    DominatorTree dt;
+    dt.recalculate(f);
+
+    for (Loop *l : li) {
+        analyzeLoop(l, se, li, dt);
+    }
+    return ranges.size();
+}
+
+bool AccessRangeFinder::isCovered(Instruction *i) {
+    return covered.count(i) != 0;
+}
+
+void AccessRangeFinder::uncover(AccessRange &r) {
+    covered.erase(r.access);
+}
+
+vector<AccessRange> &AccessRangeFinder::getRanges() {
+    return ranges;
+}
+
+/*
+ * Returns a block that runs exactly when the loop of r exits, splitting
+ * the exit edge if the exit block can be reached some other way.
+ */
+BasicBlock *AccessRangeFinder::getExitBlock(AccessRange &r) {
+    TerminatorInst *ti = r.exiting->getTerminator();
+    BasicBlock *exit = ti->getSuccessor(r.exitIdx);
+
+    if (exit->getSinglePredecessor() == r.exiting) {
+        return exit;
+    }
+    return SplitCriticalEdge(ti, r.exitIdx);
+}
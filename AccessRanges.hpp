@@ -0,0 +1,57 @@
+#ifndef ACCESSRANGES_HPP
+#define ACCESSRANGES_HPP
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+
+#include <iostream>
+#include <set>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+
+typedef struct _AccessRange {
+    Instruction *access;    /* the load or store */
+    char accessType;
+    Value *base;            /* computed in front of the loop */
+    Value *stride;
+    Value *count;
+    uint64_t size;
+    BasicBlock *exiting;    /* the loop's only exiting block */
+    unsigned exitIdx;       /* successor of exiting that leaves the loop */
+} AccessRange;
+
+/*
+ * Finds loads and stores whose address is an affine function of the
+ * induction variable of their loop, and that run exactly once in every
+ * iteration of a loop with a computable trip count. Their per-iteration
+ * events can be replaced by one logAccessRange() call at the loop exit.
+ *
+ * Enabled with DIN_ACCESS_RANGES=1.
+ */
+class AccessRangeFinder {
+    private:
+        set<Instruction *> covered;
+        vector<AccessRange> ranges;
+
+        bool findExit(Loop *l, BasicBlock *&exiting, unsigned &exitIdx);
+        void analyzeLoop(Loop *l, ScalarEvolution &se, LoopInfo &li,
+                DominatorTree &dt);
+
+    public:
+        bool enabled();
+        /* Returns the number of accesses of f summarized as ranges */
+        size_t analyzeFunction(Function &f, ScalarEvolution &se, LoopInfo &li);
+        bool isCovered(Instruction *i);
+        /* Back to per-iteration events, for a range that cannot be logged */
+        void uncover(AccessRange &r);
+        vector<AccessRange> &getRanges();
+        /* NULL if the exit edge cannot be split */
+        BasicBlock *getExitBlock(AccessRange &r);
+};
+
+#endif
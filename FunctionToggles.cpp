@@ -0,0 +1,32 @@
+#include "FunctionToggles.hpp"
+
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalVariable.h"
+
+#include "library/dinamite_fntable.h"
+
+#include <string.h>
+#include <vector>
+
+bool FunctionToggleManager::enabled() {
+    const char * val = ::getenv("DIN_FN_TOGGLES");
+    return (val != 0) && (strcmp(val, "") != 0) && (strcmp(val, "0") != 0);
+}
+
+Constant *FunctionToggleManager::getSwitch(Module *m, int64_t fnId) {
+    LLVMContext &ctx = m->getContext();
+    GlobalVariable *table = m->getGlobalVariable(DINAMITE_FN_TABLE);
+    if (table == NULL) {
+        ArrayType *t = ArrayType::get(Type::getInt8Ty(ctx),
+                                      DINAMITE_FN_TABLE_SIZE);
+        table = new GlobalVariable(*m, t, false,
+                                   GlobalValue::ExternalLinkage, NULL,
+                                   DINAMITE_FN_TABLE);
+    }
+
+    vector<Constant *> idx;
+    idx.push_back(ConstantInt::get(Type::getInt64Ty(ctx), 0));
+    idx.push_back(ConstantInt::get(Type::getInt64Ty(ctx),
+                                   DINAMITE_FN_SLOT(fnId)));
+    return ConstantExpr::getInBoundsGetElementPtr(table, idx);
+}
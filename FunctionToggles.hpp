@@ -0,0 +1,32 @@
+#ifndef FUNCTIONTOGGLES_HPP
+#define FUNCTIONTOGGLES_HPP
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Module.h"
+
+#include <iostream>
+
+using namespace std;
+using namespace llvm;
+
+/*
+ * Per-function switches, flipped at run time (see
+ * library/dinamite_fntable.h): an instrumented function starts with a
+ * load of its byte of the runtime's table, at the slot of its function
+ * ID, and tail-calls the clean copy that sampling keeps (see
+ * Sampling.hpp) while the byte is set. A disabled function runs no
+ * probes, but every call still pays for the function's prologue and
+ * frame, the load, a branch and a jump to the copy (possibly a full
+ * call when it takes byval arguments). The copy is a second body of
+ * the function in the binary.
+ *
+ * Enabled with DIN_FN_TOGGLES=1.
+ */
+class FunctionToggleManager {
+    public:
+        bool enabled();
+        /* The address of the switch of the function with ID fnId */
+        Constant *getSwitch(Module *m, int64_t fnId);
+};
+
+#endif
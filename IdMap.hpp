@@ -2,55 +2,65 @@
 #define IDMAP_HPP
 
 #include <iostream>
-#include <fstream>
-#include <sstream>
-#include <map>
-#include <sys/file.h>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "library/dinamite_idstore.h"
 
 using namespace std;
 
-#define DEFAULT_CHUNK_SIZE 1024
+/*
+ * The process-wide view of the ID store (see library/dinamite_idstore.h):
+ * the store file mapped read-only, replayed into hash indexes as it
+ * grows. Names are appended to the store the first time they are seen.
+ *
+ * With DIN_HASH_IDS set, a name's ID is its hash, and new names are
+ * only queued, to be appended in one write when the maps are saved.
+ * Replaying that write is what checks the names for hash collisions.
+ *
+ * A compiler may run the pass on several modules at once, one thread
+ * each (parallel LTO backends), so every entry point takes the lock.
+ */
+struct IdStore {
+    int fd;
+    string fname;
+    uint8_t *base;
+    size_t mapped;
+    size_t scanned;
 
-// Possible chunk status
-#define CHUNK_NOT_INIT 0
-#define CHUNK_OPENED 1
-#define CHUNK_BEING_USED 2
-#define CHUNK_FULL 3
+    unordered_map<string, int64_t> ids[IDSTORE_FUNCTION_SIZES];
+    int64_t nextId[IDSTORE_FUNCTION_SIZES];
+    unordered_map<string, int64_t> sizes;
 
-struct Chunk {
-    int id;
-    int status;
-    int start;
-    int end;
-    Chunk(): id(0), status(CHUNK_NOT_INIT), start(0), end(0) {}
-};
+    bool hashIds;
+    bool mixed;
+    vector<uint8_t> pending;
+    unordered_map<int64_t, string> owners[IDSTORE_FUNCTION_SIZES];
+    set<string> collisions;
 
-struct FileLocker {
-    int fd;
-    FileLocker(string file) {
-        fd = open((file + ".lock").c_str(), O_RDWR|O_CREAT, 0666);
-        if (flock(fd, LOCK_EX) != 0) cerr << "Error while locking " << file << ".lock fd=" << fd << endl;
-    }
-    ~FileLocker() {
-        if (flock(fd, LOCK_UN) != 0) cerr << "Error while unlocking fd=" << fd << endl;
-        close(fd);
+    mutex lock;
+
+    static IdStore &get() {
+        static IdStore store;
+        return store;
     }
-};
 
-struct IdMap {
-    map<string, int> id_map;
-    map<string, int> new_id_map;
-    Chunk curchunk;
-    
-    string fname;
-    string fchunkspool;
-    int flockd;
+    IdStore() : base(NULL), mapped(0), scanned(0), mixed(false) {
+        const char * val = ::getenv("DIN_HASH_IDS");
+        hashIds = (val != 0) && (strcmp(val, "") != 0) && (strcmp(val, "0") != 0);
 
-    IdMap(string filename) {
-        const char * val = ::getenv("DIN_MAPS");
+        val = ::getenv("DIN_MAPS");
         string prefix = "./";
         if ((val == 0) || (strcmp(val,"") == 0)) {
             cerr << "DIN_MAPS not set, falling back to current directory" << endl;
@@ -58,147 +68,184 @@ struct IdMap {
             prefix = val;
             prefix += "/";
         }
+        fname = prefix + IDSTORE_FILE;
 
-        fname = prefix + filename;
-        fchunkspool = fname + ".chunkspool.json";
+        for (int kind = 0; kind < IDSTORE_FUNCTION_SIZES; kind++) {
+            nextId[kind] = 0;
+        }
 
-        readMap();
-        curchunk = Chunk();
-        reserveNewChunk();
+        fd = open(fname.c_str(), O_RDWR|O_CREAT|O_APPEND, 0666);
+        if (fd < 0) {
+            cerr << "Error opening " << fname << ": " << strerror(errno) << endl;
+            exit(-1);
+        }
+        catchUp(0);
     }
 
-    ~IdMap() {
-        recycleCurChunk();
+    ~IdStore() {
+        if (base != NULL) munmap(base, mapped);
+        close(fd);
     }
 
-    void readMap() { // thread safe
-        FileLocker lock(fname);
-        readMapFromJson(id_map, fname);
-    }
+    int64_t getId(int kind, const string &name) {
+        lock_guard<mutex> guard(lock);
+        auto it = ids[kind].find(name);
+        if (it != ids[kind].end()) return it->second;
 
+        if (hashIds) {
+            int64_t hash = idstore_hash(name.data(), name.size());
+            ids[kind][name] = hash;
+            encode(pending, kind, name, hash, IDSTORE_HASHED);
+            return hash;
+        }
 
-    void saveMap() { // thread safe
-        FileLocker lock(fname);
-        readMapFromJson(id_map, fname);
-        id_map.insert(new_id_map.begin(), new_id_map.end());
-        writeMapToJson(id_map, fname);
+        append(kind, name, 0);
+        it = ids[kind].find(name);
+        if (it == ids[kind].end()) {
+            cerr << "Error: " << name << " missing from " << fname << endl;
+            exit(-1);
+        }
+        return it->second;
     }
 
-    int getId(string src) {
-        if (id_map.count(src) != 0) return id_map[src];
-        if (new_id_map.count(src) != 0) return new_id_map[src];
+    /* The first size recorded for a function is the one that sticks */
+    void putSize(const string &name, int64_t size) {
+        lock_guard<mutex> guard(lock);
+        if (sizes.count(name) != 0) return;
+        append(IDSTORE_FUNCTION_SIZES, name, size);
+    }
 
-        if (curchunk.start > curchunk.end) {
-            reserveNewChunk();
+    /*
+     * Append the queued hashed names and check everything the store
+     * now holds for collisions. Called when the maps are saved.
+     */
+    void flush() {
+        lock_guard<mutex> guard(lock);
+        if (!pending.empty()) {
+            write(pending);
+            pending.clear();
+        }
+        if (mixed) {
+            cerr << "Warning: " << fname << " mixes hashed and sequential IDs, "
+                 << "maps exported from it will be inconsistent" << endl;
+            mixed = false;
+        }
+        if (!collisions.empty()) {
+            for (const string &c : collisions) {
+                cerr << "Error: ID hash collision in " << fname << ": " << c << endl;
+            }
+            exit(-1);
         }
-        int new_id = curchunk.start++;
-        new_id_map[src] = new_id;
-        return new_id;
     }
 
-    inline string s(int i) {
-        char buf[33];
-        sprintf(buf, "%d", i);
-        return string(buf);
+    void encode(vector<uint8_t> &buf, int kind, const string &name,
+                int64_t value, uint32_t flags) {
+        idstore_record r;
+        memset(&r, 0, sizeof(r));
+        r.magic = IDSTORE_MAGIC;
+        r.kind = kind;
+        r.name_len = name.size();
+        r.length = IDSTORE_RECORD_LENGTH(r.name_len);
+        r.value = value;
+        r.flags = flags;
+        r.checksum = idstore_checksum(&r, name.data());
+
+        size_t off = buf.size();
+        buf.resize(off + r.length, 0);
+        memcpy(&buf[off], &r, sizeof(r));
+        memcpy(&buf[off + sizeof(r)], name.data(), name.size());
     }
 
-    inline void putChunk(map<string, int> &pool, Chunk &chk) {
-        string name = "chunk_" + s(chk.id);
-        pool[name + "_status"] = chk.status;
-        pool[name + "_start"] = chk.start;
-        pool[name + "_end"] = chk.end;
+    void append(int kind, const string &name, int64_t value) {
+        vector<uint8_t> buf;
+        encode(buf, kind, name, value, 0);
+        write(buf);
     }
 
-    inline void getChunk(map<string, int> &pool, int id, Chunk &chk) {
-        string name = "chunk_" + s(id);
-        chk.id = id;
-        chk.status = pool[name + "_status"];
-        chk.start = pool[name + "_start"];
-        chk.end = pool[name + "_end"];
+    void write(const vector<uint8_t> &buf) {
+        /* One O_APPEND write: records of concurrent compilers never mix */
+        ssize_t ret = ::write(fd, &buf[0], buf.size());
+        if (ret != (ssize_t)buf.size()) {
+            cerr << "Error appending to " << fname << ": "
+                 << (ret < 0 ? strerror(errno) : "short write") << endl;
+            exit(-1);
+        }
+        catchUp(lseek(fd, 0, SEEK_CUR));
     }
 
-    void reserveNewChunk() { // thread safe
-        FileLocker lock(fchunkspool);
-
-        map<string, int> pool;
-        readMapFromJson(pool, fchunkspool);
-
-        if (pool.count("size_of_each_chunk") == 0) {
-            pool["size_of_each_chunk"] = DEFAULT_CHUNK_SIZE;
+    /*
+     * Replay what was appended since the last call. Everything before
+     * `complete' (the end of our own last append) has been fully
+     * written, so a record there that looks unfinished is garbage.
+     */
+    void catchUp(size_t complete) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            cerr << "Error reading " << fname << ": " << strerror(errno) << endl;
+            exit(-1);
         }
-        if (pool.count("latest_chunk_id") == 0) {
-            pool["latest_chunk_id"] = -1;
-        }
-
-        // update current chunk in the pool
-        if (curchunk.status != CHUNK_NOT_INIT) {
-            curchunk.status = curchunk.start > curchunk.end ? CHUNK_FULL : CHUNK_OPENED;
-            putChunk(pool, curchunk);
+        size_t size = st.st_size;
+        if (size <= scanned) return;
+
+        if (size > mapped) {
+            if (base != NULL) munmap(base, mapped);
+            base = (uint8_t *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (base == MAP_FAILED) {
+                cerr << "Error mapping " << fname << ": " << strerror(errno) << endl;
+                exit(-1);
+            }
+            mapped = size;
         }
 
-        // try to find an opened chunk (the chunk that is not fully used)
-        bool foundOpenChunk = false;
-        for (int i = 0; i <= pool["latest_chunk_id"]; i++) {
-            getChunk(pool, i, curchunk);
-            if (curchunk.status == CHUNK_OPENED) {
-                curchunk.status = CHUNK_BEING_USED;
-                putChunk(pool, curchunk);
-                foundOpenChunk = true;
-                break;
+        while (scanned < size) {
+            long len = idstore_check(base + scanned, base + size);
+            if (len == 0 && scanned >= complete) break;
+            if (len <= 0) {
+                scanned++;
+                continue;
             }
+            replay((const idstore_record *)(base + scanned));
+            scanned += len;
         }
+    }
 
-        if (!foundOpenChunk) {
-            pool["latest_chunk_id"] += 1;
-            curchunk.id = pool["latest_chunk_id"];
-            curchunk.status = CHUNK_BEING_USED;
-            curchunk.start = curchunk.id * pool["size_of_each_chunk"];
-            curchunk.end = curchunk.start + pool["size_of_each_chunk"] - 1;
-            putChunk(pool, curchunk);
+    void replay(const idstore_record *r) {
+        string name((const char *)(r + 1), r->name_len);
+        if (r->kind == IDSTORE_FUNCTION_SIZES) {
+            sizes.insert(make_pair(name, r->value));
+        } else if (r->flags & IDSTORE_HASHED) {
+            auto o = owners[r->kind].insert(make_pair(r->value, name));
+            if (!o.second && o.first->second != name) {
+                collisions.insert("\"" + o.first->second + "\" and \"" + name + "\"");
+            }
+            if (hashIds) {
+                ids[r->kind].insert(make_pair(name, r->value));
+            } else {
+                mixed = true;
+            }
+        } else if (hashIds) {
+            mixed = true;
+        } else if (ids[r->kind].count(name) == 0) {
+            ids[r->kind][name] = nextId[r->kind]++;
         }
-
-        writeMapToJson(pool, fchunkspool);
     }
+};
 
-    void recycleCurChunk() { // thread safe
-        FileLocker lock(fchunkspool);
-
-        map<string, int> pool;
-        readMapFromJson(pool, fchunkspool);
-
-        // recycle the chunk if it is not fully used
-        curchunk.status = curchunk.start > curchunk.end ? CHUNK_FULL : CHUNK_OPENED;
-        putChunk(pool, curchunk);
+struct IdMap {
+    int kind;
 
-        writeMapToJson(pool, fchunkspool);
-    }
+    IdMap(int kind) : kind(kind) {}
 
-    bool readMapFromJson(map<string, int> &mp, string jsonfile) {
-        ifstream mapin;
-        mapin.open(jsonfile);
-        if (!mapin.is_open()) {
-            return false;
-        }
-        stringstream ss;
-        string err;
-        ss << mapin.rdbuf();
-        json11::Json jsmap;
-        jsmap = json11::Json::parse(ss.str(), err);
-
-        for (auto entry : jsmap.object_items()) {
-            mp[entry.first] = entry.second.int_value();
-        }
-        return true;
+    int64_t getId(const string &src) {
+        return IdStore::get().getId(kind, src);
     }
 
-    bool writeMapToJson(map<string, int> &mp, string jsonfile) {
-        ofstream mapout;
-        mapout.open(jsonfile, ofstream::trunc);
-        json11::Json jsmap(mp);
-        mapout << jsmap.dump();
-        mapout.flush();
-        mapout.close();
-        return true;
+    /*
+     * New names are appended to the store as they get their IDs, or
+     * here in hashed mode
+     */
+    void saveMap() {
+        IdStore::get().flush();
     }
 };
 
@@ -1,4 +1,5 @@
 #include "InstrumentationFilter.hpp"
+#include "IdMap.hpp"
 
 #include <iostream>
 #include <fstream>
@@ -37,33 +38,92 @@ void InstrumentationFilter::loadFilterData(const char *filename) {
 	this->filters = Json::parse(ss.str(), err);
 	if (!this->filters.is_null()) {
 		loaded = true;
+		compileFilters();
 		cerr << "DINAMITE filtering set up successfully!" << endl;
 	} else {
 		cerr << "Error parsing filters!" << endl;
 	}
 }
 
-string InstrumentationFilter::findBestFunctionMatch(string function_name) {
-	Json jsFunc = filters["whitelist"]["function_filters"][function_name];
-	if (!jsFunc.is_null()) {
-		return function_name;
-	}
-
-	jsFunc = filters["whitelist"]["function_filters"];
-	bool matched_star = false;
+/*
+ * Turn the JSON filters into plain lists once, so that deciding about a
+ * function does not walk the JSON again. Blacklists and file filters
+ * match anywhere up to their end, hence the leading "*".
+ *
+ * The filters are loaded again for every module, so whatever was
+ * compiled or decided from the previous load is dropped first.
+ */
+void InstrumentationFilter::compileFilters() {
+	functionFilters.clear();
+	functionFilterIds.clear();
+	starFilter = -1;
+	functionBlacklist.clear();
+	fileWhitelist.clear();
+	fileBlacklist.clear();
+	bestMatches.clear();
+	functionDecisions.clear();
+
+	for (auto it : filters["whitelist"]["function_filters"].object_items()) {
+		FunctionFilter ff;
+		ff.glob = it.first;
+		for (auto ev : it.second["events"].array_items()) {
+			ff.events.insert(ev.string_value());
+		}
+		Json argfilter = it.second["arguments"];
+		ff.allArgs = argfilter.is_string() &&
+			(argfilter.string_value().compare("*") == 0);
+		for (auto arg : argfilter.array_items()) {
+			ff.args.insert(arg.int_value());
+		}
 
-	for (auto it : jsFunc.object_items()) {
 		if (it.first.compare("*") == 0) {
-			matched_star = true;
-		} else if (globMatch(it.first, function_name)) {
-			return it.first;
+			starFilter = functionFilters.size();
 		}
+		functionFilterIds[it.first] = functionFilters.size();
+		functionFilters.push_back(ff);
+	}
+
+	for (auto it : filters["blacklist"]["function_filters"].array_items()) {
+		functionBlacklist.push_back("*" + it.string_value());
+	}
+	for (auto it : filters["whitelist"]["file_filters"].array_items()) {
+		fileWhitelist.push_back("*" + it.string_value());
 	}
-	if (matched_star) {
-		return "*";
+	for (auto it : filters["blacklist"]["file_filters"].array_items()) {
+		fileBlacklist.push_back("*" + it.string_value());
+	}
+}
+
+/*
+ * The whitelist filter that applies to a function: the one named after
+ * it, else the first glob that matches it, else "*". Returns -1 if there
+ * is none.
+ */
+int InstrumentationFilter::findBestFunctionMatch(string function_name) {
+	auto cached = bestMatches.find(function_name);
+	if (cached != bestMatches.end()) {
+		return cached->second;
+	}
+
+	int match = -1;
+	auto exact = functionFilterIds.find(function_name);
+	if (exact != functionFilterIds.end()) {
+		match = exact->second;
+	} else {
+		for (size_t i = 0; i < functionFilters.size(); i++) {
+			if ((int)i != starFilter &&
+			    globMatch(functionFilters[i].glob, function_name)) {
+				match = i;
+				break;
+			}
+		}
+		if (match == -1) {
+			match = starFilter;
+		}
 	}
-	return "";
 
+	bestMatches[function_name] = match;
+	return match;
 }
 
 bool InstrumentationFilter::checkFunctionFilter(string function_name,
@@ -72,6 +132,20 @@ bool InstrumentationFilter::checkFunctionFilter(string function_name,
 	if (!loaded)
 		return true; // No filters defined
 
+	pair<string, string> key(function_name, event_type);
+	auto cached = functionDecisions.find(key);
+	if (cached != functionDecisions.end()) {
+		return cached->second;
+	}
+
+	bool decision = decideFunctionFilter(function_name, event_type);
+	functionDecisions[key] = decision;
+	return decision;
+}
+
+bool InstrumentationFilter::decideFunctionFilter(string function_name,
+						 string event_type) {
+
 	if (checkFunctionBlacklist(function_name)) {
 #ifdef INSFILT_DEBUG
 		cerr << "Function filter: Function " << function_name <<
@@ -86,8 +160,7 @@ bool InstrumentationFilter::checkFunctionFilter(string function_name,
 		}
 	}
 
-	if  (filters["whitelist"]["function_filters"].object_items().size()
-	     == 0) {
+	if (functionFilters.size() == 0) {
 #ifdef INSFILT_DEBUG
 		cerr << "Function filter: Function " << function_name <<
 			" enabled, whitelist empty." << endl;
@@ -95,18 +168,14 @@ bool InstrumentationFilter::checkFunctionFilter(string function_name,
 		return true;
 	}
 
-	string match_name = findBestFunctionMatch(function_name);
-	Json eventarray =
-		filters["whitelist"]["function_filters"][match_name]["events"];
-	for (auto it : eventarray.array_items()) {
-		if (event_type.compare(it.string_value()) == 0) {
+	int match = findBestFunctionMatch(function_name);
+	if (match != -1 && functionFilters[match].events.count(event_type)) {
 #ifdef INSFILT_DEBUG
-			cerr << "Function filter: Function " << function_name
-			     << " event: " << event_type << " enabled as "
-			     << match_name << endl;
+		cerr << "Function filter: Function " << function_name
+		     << " event: " << event_type << " enabled as "
+		     << functionFilters[match].glob << endl;
 #endif
-			return true;
-		}
+		return true;
 	}
 	return false;
 }
@@ -114,21 +183,12 @@ bool InstrumentationFilter::checkFunctionFilter(string function_name,
 bool InstrumentationFilter::checkFunctionArgFilter(string function_name, int arg) {
     if (!loaded) return false; // don't print args if we haven't enabled it explicitly
 
-	string match_name = findBestFunctionMatch(function_name);
-	Json argfilter = filters["whitelist"]["function_filters"][match_name]["arguments"];
-    if (argfilter.is_array()) {
-        for (auto it : argfilter.array_items()) {
-            if (it.int_value() == arg) {
-                return true;
-            }
-        }
-    } else if (argfilter.is_string()) {
-        if (argfilter.string_value().compare("*") == 0) {
-            return true;
-        }
+	int match = findBestFunctionMatch(function_name);
+    if (match == -1) {
+        return false;
     }
-
-    return false;
+    return functionFilters[match].allArgs ||
+        (functionFilters[match].args.count(arg) != 0);
 }
 
 bool InstrumentationFilter::checkFileFilter(string file_name) {
@@ -138,50 +198,24 @@ bool InstrumentationFilter::checkFileFilter(string file_name) {
 	if (checkFileBlacklist(file_name))
 		return false;
 
-	Json filearray = filters["whitelist"]["file_filters"];
-	if (filearray.is_null())
-		return true;
-
-	if  (filearray.array_items().size() == 0)
+	if (fileWhitelist.size() == 0)
 		return true;
 
-	for (auto it : filearray.array_items()) {
-		if (globMatch("*" + it.string_value(), file_name)) {
-			return true;
-		}
-	}
-	return false;
+	return globMatchAny(fileWhitelist, file_name);
 }
 
 bool InstrumentationFilter::checkFunctionBlacklist(string function_name) {
 	if (!loaded)
 		return false;
 
-	Json functionarray = filters["blacklist"]["function_filters"];
-
-	if (functionarray.is_null())
-		return false;
-
-	for (auto it : functionarray.array_items()) {
-		if (globMatch("*" + it.string_value(), function_name))
-			return true;
-	}
-	return false;
+	return globMatchAny(functionBlacklist, function_name);
 }
 
 bool InstrumentationFilter::checkFileBlacklist(string file_name) {
 	if (!loaded)
 		return false;
 
-	Json filearray = filters["blacklist"]["file_filters"];
-	if (filearray.is_null())
-		return false;
-
-	for (auto it : filearray.array_items()) {
-		if (globMatch("*" + it.string_value(), file_name))
-			return true;
-	}
-	return false;
+	return globMatchAny(fileBlacklist, file_name);
 }
 
 bool InstrumentationFilter::loopCheckEnabled() {
@@ -198,11 +232,11 @@ bool InstrumentationFilter::loopCheckEnabled() {
 bool InstrumentationFilter::checkFunctionSize(string function_name,
 					      size_t size) {
 
-	if ((size > 0) && (functions.count(function_name) == 0)) {
+	if (size > 0) {
 		/* Add to the list of encountered functions, mostly
 		 * used for mangled stuff
 		 */
-		functions[function_name] = size;
+		IdStore::get().putSize(function_name, size);
 	}
 
 	if (filters["minimum_function_size"].is_null()) {
@@ -215,11 +249,12 @@ bool InstrumentationFilter::checkFunctionSize(string function_name,
 #endif
 		return true;
 	}
-	string bestMatch = findBestFunctionMatch(function_name);
-	if ((bestMatch.compare("*") != 0) && (bestMatch.compare("") != 0)) {
+	int bestMatch = findBestFunctionMatch(function_name);
+	if ((bestMatch != starFilter) && (bestMatch != -1)) {
 #ifdef INSFILT_DEBUG
 		cerr << "Size filter: Function " << function_name << " size: "
-		     << size << ", matched against " << bestMatch << endl;
+		     << size << ", matched against "
+		     << functionFilters[bestMatch].glob << endl;
 #endif
 		return true;
 	}
@@ -231,28 +266,42 @@ bool InstrumentationFilter::checkFunctionSize(string function_name,
 	return false;
 }
 
-bool InstrumentationFilter::globMatch(string glob, string s) {
+/*
+ * '*' matches any run of characters. Matches greedily and, on a
+ * mismatch, backs up to the last '*' only, letting it swallow one more
+ * character: earlier stars never need revisiting, so this takes at most
+ * glob length times string length steps, however many stars there are.
+ */
+bool InstrumentationFilter::globMatch(const string &glob, const string &s) {
+	size_t g = 0, i = 0;
+	size_t star = string::npos, mark = 0;
+
+	while (i < s.length()) {
+		if (g < glob.length() && glob[g] == '*') {
+			star = g++;
+			mark = i;
+		} else if (g < glob.length() && glob[g] == s[i]) {
+			g++;
+			i++;
+		} else if (star != string::npos) {
+			g = star + 1;
+			i = ++mark;
+		} else {
+			return false;
+		}
+	}
+	while (g < glob.length() && glob[g] == '*')
+		g++;
+	return g == glob.length();
+}
 
-	/* both done, matched */
-	if ((glob.length() == 0) && (s.length() == 0))
-		return true;
-        /* one is done, other has leftover characters */ 
-	if (glob.length() * s.length() == 0) {
-		if (glob.compare("*") == 0)
+bool InstrumentationFilter::globMatchAny(const vector<string> &globs,
+					 const string &s) {
+	for (auto &glob : globs) {
+		if (globMatch(glob, s))
 			return true;
-		return false;
-	}
-	if (glob[0] == '*') { // recurse for both match cases
-		return 
-			globMatch(glob.substr(1), s.substr(1)) || 
-			globMatch(glob, s.substr(1)) || 
-			globMatch(glob.substr(1), s);
-	}
-	if (glob[0] != s[0]) {  // regular characters
-		return false;
-	} else {
-		return globMatch(glob.substr(1), s.substr(1));
 	}
+	return false;
 }
 
 fn_size_metrics InstrumentationFilter::getFunctionSizeMetric() {
@@ -9,63 +9,52 @@
 #include <sstream>
 #include <fstream>
 #include <map>
+#include <set>
+#include <vector>
 
 using namespace std;
 using namespace json11;
 typedef enum {FN_SIZE_LOC, FN_SIZE_IR, FN_SIZE_PATH} fn_size_metrics;
 
+/* A whitelist function filter, as compiled from the JSON */
+typedef struct _FunctionFilter {
+    string glob;
+    set<string> events;
+    bool allArgs;
+    set<int> args;
+} FunctionFilter;
+
 class InstrumentationFilter {
     private:
         Json filters;
         bool loaded;
-        string fname;
-        map<string, int> functions;
 
-        bool globMatch(string glob, string s);
+        /* Compiled once the filters are loaded */
+        vector<FunctionFilter> functionFilters; // in JSON key order
+        map<string, int> functionFilterIds;     // by exact name
+        int starFilter;
+        vector<string> functionBlacklist;
+        vector<string> fileWhitelist;
+        vector<string> fileBlacklist;
+
+        /* Memoized decisions */
+        map<string, int> bestMatches;
+        map<pair<string, string>, bool> functionDecisions;
+
+        void compileFilters();
+        bool globMatch(const string &glob, const string &s);
+        bool globMatchAny(const vector<string> &globs, const string &s);
         void testGlob();
 
         bool checkFunctionBlacklist(string function_name);
         bool checkFileBlacklist(string file_name);
-        string findBestFunctionMatch(string function_name);
+        int findBestFunctionMatch(string function_name);
+        bool decideFunctionFilter(string function_name, string event_type);
 
     public:
 
-        InstrumentationFilter() : loaded(false) {
-            string filename("function_sizes.json");
-            const char * val = ::getenv("DIN_MAPS");
-            string prefix = "./";
-            if ((val == 0) || (strcmp(val,"") == 0)) {
-                cerr << "DIN_MAPS not set, falling back to current directory" << endl;
-            } else {
-                prefix = val;
-                prefix += "/";
-            }
-
-            ifstream mapin;
-            fname = prefix + filename;
-            mapin.open(fname);
-            if (!mapin.is_open()) {
-                return;
-            }
-            stringstream ss;
-            string err;
-            ss << mapin.rdbuf();
-            json11::Json jsmap;
-            jsmap = json11::Json::parse(ss.str(), err);
-            for (auto entry : jsmap.object_items()) {
-                functions[entry.first] = entry.second.int_value();
-            }
-        };
-
-        ~InstrumentationFilter() {
-            ofstream outfile;
-            outfile.open(fname, ofstream::trunc);
-            json11::Json jsmap(functions);
-            outfile << jsmap.dump();
-            outfile.flush();
-            outfile.close();
+        InstrumentationFilter() : loaded(false), starFilter(-1) {}
 
-        }
         void loadFilterData(const char *filename);
         void loadFilterDataEnv();
 
@@ -0,0 +1,195 @@
+#include "InstrumentationStats.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *probeKinds[] = {"fn", "r", "w", "a", "range", "alloc"};
+
+bool InstrumentationStats::enabled() {
+    const char * val = ::getenv("DIN_STATS");
+    on = (val != 0) && (strcmp(val, "") != 0) && (strcmp(val, "0") != 0);
+    return on;
+}
+
+void InstrumentationStats::beginModule(Module &m) {
+    moduleName = m.getModuleIdentifier();
+    functions.clear();
+    current = NULL;
+}
+
+void InstrumentationStats::beginFunction(Function &f, const string &demangled,
+                                         const char *metric, size_t size) {
+    current = NULL;
+    if (!on) {
+        return;
+    }
+
+    FunctionStats &fs = functions[f.getName().str()];
+    fs.demangled = demangled;
+    fs.metric = metric;
+    fs.size = size;
+    fs.decision = "";
+    fs.events.clear();
+    fs.probes.clear();
+    for (const char *kind : probeKinds) {
+        fs.probes[kind] = 0;
+    }
+    fs.counts.clear();
+    fs.overhead = 0;
+    fs.sampled = false;
+
+    loopDepths.clear();
+    current = &fs;
+}
+
+void InstrumentationStats::endFunction() {
+    current = NULL;
+    loopDepths.clear();
+}
+
+void InstrumentationStats::setDecision(const string &decision, bool function,
+                                       bool access, bool alloc) {
+    if (current == NULL) {
+        return;
+    }
+    current->decision = decision;
+    if (function) current->events.push_back("function");
+    if (access) current->events.push_back("access");
+    if (alloc) current->events.push_back("alloc");
+}
+
+void InstrumentationStats::setLoopDepths(LoopInfo &li) {
+    if (current == NULL) {
+        return;
+    }
+    for (auto it = li.begin(); it != li.end(); it++) {
+        for (BasicBlock *b : (*it)->getBlocks()) {
+            loopDepths[b] = li.getLoopDepth(b);
+        }
+    }
+}
+
+/* Blocks added after setLoopDepths() count as outside any loop */
+unsigned InstrumentationStats::getLoopDepth(BasicBlock *b) {
+    auto it = loopDepths.find(b);
+    return it == loopDepths.end() ? 0 : it->second;
+}
+
+void InstrumentationStats::addProbe(const char *kind, unsigned depth) {
+    if (current == NULL) {
+        return;
+    }
+    double weight = 1;
+    for (unsigned i = 0; i < depth; i++) {
+        weight *= loopTrips;
+    }
+    current->probes[kind]++;
+    current->overhead += weight;
+}
+
+void InstrumentationStats::addProbe(const char *kind, BasicBlock *b) {
+    if (current == NULL) {
+        return;
+    }
+    addProbe(kind, getLoopDepth(b));
+}
+
+void InstrumentationStats::setCount(const char *what, size_t n) {
+    if (current == NULL) {
+        return;
+    }
+    current->counts[what] = n;
+}
+
+void InstrumentationStats::setSampled() {
+    if (current == NULL) {
+        return;
+    }
+    current->sampled = true;
+}
+
+static void addTotal(map<string, double> &totals, const string &key, double n) {
+    totals[key] += n;
+}
+
+Json InstrumentationStats::moduleReport() {
+    Json::object fns;
+    map<string, double> totals;
+
+    for (auto &it : functions) {
+        FunctionStats &fs = it.second;
+        Json::object probes;
+        Json::object fn;
+
+        for (auto &p : fs.probes) {
+            probes[p.first] = (double)p.second;
+            addTotal(totals, p.first, p.second);
+        }
+        fn["demangled"] = fs.demangled;
+        fn["metric"] = fs.metric;
+        fn["size"] = (double)fs.size;
+        fn["decision"] = fs.decision;
+        fn["events"] = Json::array(fs.events.begin(), fs.events.end());
+        fn["probes"] = probes;
+        fn["overhead"] = fs.overhead;
+        for (auto &c : fs.counts) {
+            fn[c.first] = (double)c.second;
+            addTotal(totals, c.first, c.second);
+        }
+        if (fs.sampled) {
+            fn["sampled"] = true;
+        }
+        fns[it.first] = fn;
+
+        addTotal(totals, "functions", 1);
+        if (fs.decision == "instrumented") {
+            addTotal(totals, "instrumented", 1);
+        }
+        addTotal(totals, "overhead", fs.overhead);
+    }
+
+    Json::object module;
+    module["functions"] = fns;
+    module["totals"] = Json(totals);
+    return module;
+}
+
+/*
+ * The fields are written in the order dinamite-maps expects them. One
+ * O_APPEND write per module: records of concurrent compilers never mix,
+ * and no compiler has to read what the others wrote.
+ */
+void InstrumentationStats::save() {
+    if (!on) {
+        return;
+    }
+
+    const char * val = ::getenv("DIN_MAPS");
+    string prefix = "./";
+    if ((val != 0) && (strcmp(val, "") != 0)) {
+        prefix = val;
+        prefix += "/";
+    }
+    string fname = prefix + STATS_LOG;
+
+    Json report = moduleReport();
+    string record = "{\"module\": " + Json(moduleName).dump() +
+        ", \"totals\": " + report["totals"].dump() +
+        ", \"functions\": " + report["functions"].dump() + "}\n";
+
+    int fd = open(fname.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0666);
+    if (fd < 0) {
+        cerr << "Error opening " << fname << ": " << strerror(errno)
+             << ", statistics not saved" << endl;
+        return;
+    }
+    ssize_t ret = ::write(fd, record.data(), record.size());
+    if (ret != (ssize_t)record.size()) {
+        cerr << "Error appending to " << fname << ": "
+             << (ret < 0 ? strerror(errno) : "short write") << endl;
+    }
+    close(fd);
+}
@@ -0,0 +1,86 @@
+#ifndef INSTRUMENTATIONSTATS_HPP
+#define INSTRUMENTATIONSTATS_HPP
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/Analysis/LoopInfo.h"
+
+#include "json11.hpp"
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+using namespace json11;
+
+#define STATS_LOG "instrumentation_stats.log"
+#define STATS_FILE "instrumentation_stats.json"
+
+/*
+ * What the pass did to each function of a module: the probes it
+ * inserted, by kind (fn, r, w, a, range, alloc), the size metric and
+ * the filter decision, and a static estimate of the probes one call to
+ * the function runs, each probe weighted by loopTrips to the power of
+ * its loop depth. Appended to $DIN_MAPS/instrumentation_stats.log, one
+ * line per module:
+ *
+ *     {"module": <identifier>, "totals": {...}, "functions": {...}}
+ *
+ * dinamite-maps merges the log into instrumentation_stats.json, which
+ * holds the report of every module, the last one logged for a module
+ * identifier winning, and the totals over all of them.
+ *
+ * Enabled with DIN_STATS=1.
+ */
+class InstrumentationStats {
+    private:
+        struct FunctionStats {
+            string demangled;
+            string metric;
+            size_t size;
+            string decision;
+            vector<string> events;
+            map<string, size_t> probes;
+            map<string, size_t> counts;
+            double overhead;
+            bool sampled;
+        };
+
+        bool on;
+        string moduleName;
+        map<string, FunctionStats> functions;
+        FunctionStats *current;
+        map<BasicBlock *, unsigned> loopDepths;
+
+        Json moduleReport();
+
+    public:
+        /* Iterations assumed for every loop */
+        static const unsigned loopTrips = 10;
+
+        InstrumentationStats() : on(false), current(NULL) {}
+
+        bool enabled();
+        void beginModule(Module &m);
+        /* The calls below apply to f, until the next beginFunction() */
+        void beginFunction(Function &f, const string &demangled,
+                           const char *metric, size_t size);
+        void endFunction();
+        void setDecision(const string &decision, bool function,
+                         bool access, bool alloc);
+        /* Must be called before the CFG of f changes */
+        void setLoopDepths(LoopInfo &li);
+        unsigned getLoopDepth(BasicBlock *b);
+        void addProbe(const char *kind, unsigned depth);
+        void addProbe(const char *kind, BasicBlock *b);
+        void setCount(const char *what, size_t n);
+        void setSampled();
+        /* Appends the module's report to the stats log */
+        void save();
+};
+
+#endif
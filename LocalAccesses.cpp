@@ -0,0 +1,47 @@
+#include "LocalAccesses.hpp"
+
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/ValueTracking.h"
+
+#include <string.h>
+
+bool LocalAccessFilter::enabled() {
+    const char * val = ::getenv("DIN_SKIP_LOCALS");
+    return (val != 0) && (strcmp(val, "") != 0) && (strcmp(val, "0") != 0);
+}
+
+void LocalAccessFilter::analyzeFunction(Function &f) {
+    locals.clear();
+
+    for (BasicBlock &b : f) {
+        for (Instruction &i : b) {
+            if (AllocaInst *ai = dyn_cast<AllocaInst>(&i)) {
+                if (!PointerMayBeCaptured(ai, true, true)) {
+                    locals.insert(ai);
+                }
+            }
+        }
+    }
+}
+
+bool LocalAccessFilter::isLocalAccess(Instruction *i) {
+    Value *ptr;
+
+    if (LoadInst *li = dyn_cast<LoadInst>(i)) {
+        ptr = li->getPointerOperand();
+    } else if (StoreInst *si = dyn_cast<StoreInst>(i)) {
+        ptr = si->getPointerOperand();
+    } else {
+        return false;
+    }
+
+    if (locals.count(GetUnderlyingObject(ptr)) == 0) {
+        return false;
+    }
+    skipped++;
+    return true;
+}
+
+size_t LocalAccessFilter::getSkipped() {
+    return skipped;
+}
@@ -0,0 +1,38 @@
+#ifndef LOCALACCESSES_HPP
+#define LOCALACCESSES_HPP
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+#include <iostream>
+#include <set>
+
+using namespace std;
+using namespace llvm;
+
+/*
+ * Finds the stack slots of a function whose address never escapes it,
+ * such as loop counters and the .addr slots of arguments at -O0. No
+ * other thread can see them, so their accesses tell us little about the
+ * program's shared state and can be left uninstrumented.
+ *
+ * Enabled with DIN_SKIP_LOCALS=1.
+ */
+class LocalAccessFilter {
+    private:
+        set<const Value *> locals;
+        size_t skipped;
+
+    public:
+        LocalAccessFilter() : skipped(0) {}
+
+        bool enabled();
+        /* Must be called before any probe is inserted into f: the
+         * probes take the address of what they log */
+        void analyzeFunction(Function &f);
+        /* Counts the accesses it says yes to */
+        bool isLocalAccess(Instruction *i);
+        size_t getSkipped();
+};
+
+#endif
@@ -1,9 +1,14 @@
 #include "LogFunctionManager.hpp"
 
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/IRReader/IRReader.h>
 
+#include <mutex>
+#include <vector>
+
 #define TRACELINE() cerr << __LINE__ << endl;
 int LogFunctionManager::getSizeIndex(int size) {
     switch (size) {
@@ -20,32 +25,174 @@ int LogFunctionManager::getSizeIndex(int size) {
     };
 }
 
-string LogFunctionManager::getInstrumentationLibPath() {
+string LogFunctionManager::getInstrumentationLibPath(const char *file) {
     const char * val = ::getenv("INST_LIB");
     if ((val == 0) || (strcmp(val,"") == 0)) {
-        cerr << "INST_LIB path not set, defaulting to ./library/instrumentation.bc" << endl;
-        return "./library/instrumentation.bc";
+        string s = "./library/";
+        s += file;
+        cerr << "INST_LIB path not set, defaulting to " << s << endl;
+        return s;
     }
     else {
         string s = val;
-        s += "/instrumentation.bc";
+        s += "/";
+        s += file;
         cerr << "Instrumentation bitcode at " << s << endl;
         return s;
     }
 }
 
+/*
+ * The probes' declarations, from instrumentation.bc. The file is read
+ * once per process, lazily so that no function body is ever
+ * materialized, into a context of its own. A compiler may run the pass
+ * on many modules, even at once on threads with contexts of their own
+ * (parallel LTO backends); each module gets declarations with the same
+ * signatures in its context.
+ */
+static mutex probeLibLock;
+static LLVMContext *probeLibContext;
+static Module *probeLib;
+
+Module *LogFunctionManager::getProbeLib() {
+    lock_guard<mutex> guard(probeLibLock);
+    if (probeLib != NULL) {
+        return probeLib;
+    }
+
+    string path = getInstrumentationLibPath("instrumentation.bc");
+    SMDiagnostic error;
+    probeLibContext = new LLVMContext();
+    probeLib = getLazyIRFileModule(path, error, *probeLibContext);
+    if (probeLib == NULL) {
+        cerr << "Could not load " << path << ": "
+             << error.getMessage().str() << ", exiting" << endl;
+        exit(-1);
+    }
+    return probeLib;
+}
+
+/* The probes take and return only scalars and pointers to them */
+static Type *translateType(Type *t, LLVMContext &ctx) {
+    switch (t->getTypeID()) {
+        case Type::VoidTyID:
+            return Type::getVoidTy(ctx);
+        case Type::FloatTyID:
+            return Type::getFloatTy(ctx);
+        case Type::DoubleTyID:
+            return Type::getDoubleTy(ctx);
+        case Type::IntegerTyID:
+            return IntegerType::get(ctx, t->getIntegerBitWidth());
+        case Type::PointerTyID: {
+            Type *elem = translateType(t->getPointerElementType(), ctx);
+            if (elem == NULL) {
+                return NULL;
+            }
+            return PointerType::get(elem, t->getPointerAddressSpace());
+        }
+        default:
+            return NULL;
+    }
+}
+
 Function * LogFunctionManager::loadExternalFunction(Module *m, Module *extM, const char *name) {
+    /* Probes linked in by linkInlineProbes() are used as they are */
+    Function *existing = m->getFunction(name);
+    if (existing != NULL && inlineProbes.count(existing) != 0) {
+        return existing;
+    }
+
     Function *fn = extM->getFunction(name);
-    FunctionType *ft = fn->getFunctionType();
+    if (fn == NULL) {
+        cerr << "Function " << name << " not found, exiting" << endl;
+        exit(-1);
+    }
+
+    FunctionType *extFt = fn->getFunctionType();
+    Type *ret = translateType(extFt->getReturnType(), m->getContext());
+    vector<Type *> params;
+    for (auto it = extFt->param_begin(); it != extFt->param_end(); it++) {
+        params.push_back(translateType(*it, m->getContext()));
+        if (params.back() == NULL) {
+            ret = NULL;
+        }
+    }
+    if (ret == NULL) {
+        cerr << "Function " << name << " has an unsupported signature, exiting" << endl;
+        exit(-1);
+    }
+    FunctionType *ft = FunctionType::get(ret, params, extFt->isVarArg());
+
+    /* Declared already, by an earlier run of the pass over m */
+    if (existing != NULL && existing->getFunctionType() == ft) {
+        return existing;
+    }
+
     Function *newFn = Function::Create(ft, Function::ExternalWeakLinkage, name, m);
     return newFn;
 }
 
 
-void LogFunctionManager::loadFunctions(Module *m) {
-    LLVMContext context;
+bool LogFunctionManager::inlineProbesEnabled() {
+    const char * val = ::getenv("DIN_INLINE_PROBES");
+    return (val != 0) && (strcmp(val, "") != 0) && (strcmp(val, "0") != 0);
+}
+
+/*
+ * With DIN_INLINE_PROBES set, link the probes of the binary runtime
+ * from instrumentation_inline.bc into the module, so that their fast
+ * path (TLS cursor bump and record encoding) is inlined at every
+ * instrumented access instead of being an 8-argument call. The bitcode
+ * is built from the same source as the runtime library, so the record
+ * and TLS layout always match it; only the slow path, taken when the
+ * buffer is full, calls into the library.
+ */
+void LogFunctionManager::linkInlineProbes(Module *m) {
     SMDiagnostic error;
-    Module *lib = ParseIRFile(getInstrumentationLibPath().c_str(), error, m->getContext());
+    string path = getInstrumentationLibPath("instrumentation_inline.bc");
+    Module *probes = ParseIRFile(path.c_str(), error, m->getContext());
+
+    if (probes == NULL) {
+        cerr << "Could not load " << path << ", probes will be called" << endl;
+        return;
+    }
+
+    vector<string> names;
+    for (Function &f : *probes) {
+        if (!f.isDeclaration()) {
+            names.push_back(f.getName().str());
+        }
+    }
+
+    string err;
+    if (Linker::LinkModules(m, probes, Linker::DestroySource, &err)) {
+        cerr << "Could not link " << path << ": " << err
+             << ", probes will be called" << endl;
+        delete probes;
+        return;
+    }
+    delete probes;
+
+    for (auto &name : names) {
+        Function *f = m->getFunction(name);
+        if (f == NULL) {
+            continue;
+        }
+        f->setLinkage(GlobalValue::InternalLinkage);
+        f->removeFnAttr(Attribute::NoInline);
+        f->removeFnAttr(Attribute::OptimizeNone);
+        f->addFnAttr(Attribute::AlwaysInline);
+        inlineProbes.insert(f);
+    }
+    cerr << "Inlining " << inlineProbes.size() << " probe functions" << endl;
+}
+
+void LogFunctionManager::loadFunctions(Module *m) {
+    Module *lib = getProbeLib();
+
+    if (inlineProbesEnabled()) {
+        linkInlineProbes(m);
+    }
 
     cerr << "Loading external functions...";
     logFunctions[FLOAT][S8] = loadExternalFunction(m, lib, "logAccessF8");
@@ -58,6 +205,8 @@ void LogFunctionManager::loadFunctions(Module *m) {
     logFunctions[INTEGER][S64] = loadExternalFunction(m, lib, "logAccessI64");
     ptrLogFunc = loadExternalFunction(m, lib, "logAccessPtr");
     stringLogFunc = loadExternalFunction(m, lib, "logAccessStaticString");
+    rangeLogFunc = loadExternalFunction(m, lib, "logAccessRange");
+    sampleCheckFunc = loadExternalFunction(m, lib, "logSampleCheck");
     allocLogFunc = loadExternalFunction(m, lib, "logAlloc");
     fnBeginLogFunc = loadExternalFunction(m, lib, "logFnBegin");
     fnEndLogFunc = loadExternalFunction(m, lib, "logFnEnd");
@@ -127,8 +276,11 @@ Function * LogFunctionManager::getLogFunction(Value *v, Function *parent) {
 }
 
 bool LogFunctionManager::isLogFunction(Function *f) {
+    if (inlineProbes.count(f) != 0) return true;
     if (f->getName().equals(ptrLogFunc->getName())) return true;
     if (f->getName().equals(allocLogFunc->getName())) return true;
+    if (f->getName().equals(rangeLogFunc->getName())) return true;
+    if (f->getName().equals(sampleCheckFunc->getName())) return true;
     int i, j;
 
     for (i = 0; i < VALUE_TYPES_MAX; i++) {
@@ -140,3 +292,47 @@ bool LogFunctionManager::isLogFunction(Function *f) {
     }
     return false;
 }
+
+/*
+ * Inline every call to the linked-in probes, and to the helpers they
+ * call in turn, then drop the probe bodies. This is done here rather
+ * than left to the inliner, which does not run after the pass at -O0.
+ */
+void LogFunctionManager::inlineProbeCalls() {
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+        for (Function *f : inlineProbes) {
+            vector<CallInst *> calls;
+            for (User *u : f->users()) {
+                CallInst *ci = dyn_cast<CallInst>(u);
+                if (ci != NULL && ci->getCalledFunction() == f &&
+                    inlineProbes.count(ci->getParent()->getParent()) == 0) {
+                    calls.push_back(ci);
+                }
+            }
+            for (CallInst *ci : calls) {
+                InlineFunctionInfo ifi;
+                if (InlineFunction(ci, ifi)) {
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    changed = true;
+    while (changed) {
+        changed = false;
+        for (auto it = inlineProbes.begin(); it != inlineProbes.end(); ) {
+            Function *f = *it;
+            if (f->use_empty()) {
+                f->eraseFromParent();
+                it = inlineProbes.erase(it);
+                changed = true;
+            } else {
+                it++;
+            }
+        }
+    }
+}
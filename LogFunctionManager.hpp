@@ -6,6 +6,7 @@
 
 #include <string>
 #include <iostream>
+#include <set>
 
 enum value_types {
     FLOAT = 0, INTEGER, VALUE_TYPES_MAX
@@ -20,13 +21,20 @@ using namespace std;
 
 class LogFunctionManager {
     private:
-        string getInstrumentationLibPath();
+        set<Function *> inlineProbes;
+
+        string getInstrumentationLibPath(const char *file);
+        Module *getProbeLib();
         Function *loadExternalFunction(Module *m, Module *extM, const char *name);
+        bool inlineProbesEnabled();
+        void linkInlineProbes(Module *m);
 
     public:
         Function *logFunctions[VALUE_TYPES_MAX][VALUE_SIZES_MAX];
         Function *ptrLogFunc; 
         Function *stringLogFunc; 
+        Function *rangeLogFunc; 
+        Function *sampleCheckFunc; 
         Function *allocLogFunc; 
         Function *fnBeginLogFunc; 
         Function *fnEndLogFunc; 
@@ -37,6 +45,7 @@ class LogFunctionManager {
         void loadFunctions(Module *m);
         Function *getLogFunction(Value *v, Function *parent);
         bool isLogFunction(Function *f);
+        void inlineProbeCalls();
 };
 
 #endif
@@ -1,6 +1,6 @@
 #include "MetadataCrawler.hpp"
 
-#include <sstream>
+#include <string.h>
 
 void MetadataCrawler::traverseMetadata(MDNode *mdn, MDTraversal *traversal) {
     if (mdn == 0) {
@@ -23,15 +23,41 @@ void MetadataCrawler::traverseMetadata(MDNode *mdn, MDTraversal *traversal) {
 
 }
 
+/* Only remembers the module: it is crawled when a field name is needed */
 void MetadataCrawler::crawlModule(Module &m) {
-    NamedMDNode *nmd = m.getNamedMetadata("llvm.dbg.cu");
-    crawlNMD(nmd, &typedefTraversal);
-    crawlAllInstructions(m, &typedefTraversal);
+    module = &m;
+    crawled = false;
+    visited.clear();
+    typedefNodes.clear();
+    classNodes.clear();
+    typedefMap.clear();
+    classMap.clear();
+    fieldMap.clear();
+}
+
+/*
+ * One walk over the metadata collects the typedefs and the classes.
+ * Typedefs are resolved first, as they name the unnamed classes.
+ */
+void MetadataCrawler::crawl() {
+    crawled = true;
+    if (module == NULL) {
+        return;
+    }
 
+    NamedMDNode *nmd = module->getNamedMetadata("llvm.dbg.cu");
+    crawlNMD(nmd, &typeNodeTraversal);
+    crawlAllInstructions(*module, &typeNodeTraversal);
     visited.clear();
 
-    crawlNMD(nmd, &fieldNameTraversal);
-    crawlAllInstructions(m, &fieldNameTraversal);
+    for (MDNode *mdn : typedefNodes) {
+        addTypedef(mdn);
+    }
+    for (MDNode *mdn : classNodes) {
+        addClass(mdn);
+    }
+    typedefNodes.clear();
+    classNodes.clear();
 }
 
 void MetadataCrawler::crawlNMD(NamedMDNode *nmd, MDTraversal *mdt) {
@@ -77,92 +103,64 @@ void MetadataCrawler::crawlAllInstructions(Module &m, MDTraversal *mdt) {
     }
 }
 
-void TypedefTraversal::traverse(MDNode *mdn) {
-    if (MDNode *dit = dyn_cast<MDNode>(mdn)) {
-        if ( mdn->getNumOperands() > 0) {
-            if (mdn->getOperand(0)){ 
-                if (ConstantInt *civ = dyn_cast<ConstantInt>(mdn->getOperand(0))) {
-                    unsigned int tag = civ->getSExtValue();
-                    if (CHECK_TAG(tag, llvm::dwarf::DW_TAG_typedef)) {
-                        if (mdn->getNumOperands() > 9) {
-                            MDString *mds;
-                            if ((mdn->getOperand(3)) && (mds = dyn_cast<MDString>(mdn->getOperand(3)))) {
-                                string tdefname(mds->getString().str());
-                                MDNode *structptr;
-                                if (mdn->getOperand(9) && (structptr = dyn_cast<MDNode>(mdn->getOperand(9)))) {
-                                    if (mdc->typedefMap.count(structptr) == 0) {
-                                        mdc->typedefMap[structptr] = tdefname;
-                                    }
-                                }
-                            } else { // has no name
-                                MDNode *structptr;
-                                if ((mdn->getOperand(9)) && (structptr = dyn_cast<MDNode>(mdn->getOperand(9)))) {
-                                    if (mdc->typedefMap.count(structptr) == 0) {
-                                        ostringstream oss;
-                                        string tdefname = oss.str();
-                                        mdc->typedefMap[structptr] = tdefname;
-                                    }
-                                }
+void TypeNodeTraversal::traverse(MDNode *mdn) {
+    if ((mdn->getNumOperands() > 0) && (mdn->getOperand(0))) {
+        if (ConstantInt *civ = dyn_cast<ConstantInt>(mdn->getOperand(0))) {
+            unsigned int tag = civ->getSExtValue();
+            if (CHECK_TAG(tag, llvm::dwarf::DW_TAG_typedef)) {
+                mdc->typedefNodes.push_back(mdn);
+            } else if (CHECK_TAG(tag, llvm::dwarf::DW_TAG_class_type) || CHECK_TAG(tag, llvm::dwarf::DW_TAG_structure_type)) {
+                mdc->classNodes.push_back(mdn);
+            }
+        }
+    }
+}
 
-                            }
-                        }
-                    }
+void MetadataCrawler::addTypedef(MDNode *mdn) {
+    if (mdn->getNumOperands() > 9) {
+        MDNode *structptr;
+        if (mdn->getOperand(9) && (structptr = dyn_cast<MDNode>(mdn->getOperand(9)))) {
+            if (typedefMap.count(structptr) == 0) {
+                MDString *mds;
+                if ((mdn->getOperand(3)) && (mds = dyn_cast<MDString>(mdn->getOperand(3)))) {
+                    typedefMap[structptr] = mds->getString().str();
+                } else { // has no name
+                    typedefMap[structptr] = "";
                 }
             }
         }
     }
 }
 
-void FieldNameTraversal::traverse(MDNode *mdn) {
-    if (MDNode *dit = dyn_cast<MDNode>(mdn)) {
-        if ( mdn->getNumOperands() > 0) {
-            if (mdn->getOperand(0)){ 
-                if (ConstantInt *civ = dyn_cast<ConstantInt>(mdn->getOperand(0))) {
-                    unsigned int tag = civ->getSExtValue();
-                    if (CHECK_TAG(tag, llvm::dwarf::DW_TAG_class_type) || CHECK_TAG(tag, llvm::dwarf::DW_TAG_structure_type)) {
-#ifdef DEBUG_PRINT
-                        if (CHECK_TAG(tag, llvm::dwarf::DW_TAG_class_type)) {
-                            cerr << "Class type!" <<endl;
-                        } else {
-                            cerr << "Struct type!" <<endl;
-                        }
-#endif
-                        if ((mdn->getNumOperands() > 3) && (mdn->getOperand(3))) {
-                            StringRef className = mdn->getOperand(3)->getName();
-                            if (className.str() == "") {
-                                if (mdc->typedefMap.count(mdn)) {
-                                    className = StringRef(mdc->typedefMap[mdn]);
-                                } else if ((mdn->getNumOperands() > 14) && (mdn->getOperand(14))) {
-                                    string dmangleClass = demangle(mdn->getOperand(14)->getName().str().c_str());
-                                    if (dmangleClass.find("typeinfo name for ") != string::npos) {
-                                        dmangleClass.erase(0, strlen("typeinfo name for "));
-                                    }
-                                    className = StringRef(dmangleClass);
+/* Only indexes the class by name, its fields are read by getFieldName() */
+void MetadataCrawler::addClass(MDNode *mdn) {
+    if ((mdn->getNumOperands() > 3) && (mdn->getOperand(3))) {
+        string className = mdn->getOperand(3)->getName().str();
+        if (className == "") {
+            if (typedefMap.count(mdn)) {
+                className = typedefMap[mdn];
+            } else if ((mdn->getNumOperands() > 14) && (mdn->getOperand(14))) {
+                className = demangle(mdn->getOperand(14)->getName().str().c_str());
+                if (className.find("typeinfo name for ") != string::npos) {
+                    className.erase(0, strlen("typeinfo name for "));
+                }
 #ifdef DEBUG_PRINT
-                                    cerr << "cname14 " << className.str() << endl;
+                cerr << "cname14 " << className << endl;
 #endif
-                                } else {
-                                    className = StringRef("<unknown>");
-                                }
-                            }
+            } else {
+                className = "<unknown>";
+            }
+        }
 
-                            if (mdn->getNumOperands() > 10) {
-                                if (mdn->getOperand(10)) {
-                                    if (MDNode *fields = dyn_cast<MDNode>(mdn->getOperand(10))) {
-                                        string sClassName(className.str());
-                                        mdc->getFields(sClassName, fields);
-                                    }
-                                }
-                            }
-                        }
-                    }
-                } 
+        if ((mdn->getNumOperands() > 10) && (mdn->getOperand(10))) {
+            if (isa<MDNode>(mdn->getOperand(10))) {
+                classMap[className].push_back(mdn);
             }
         }
     }
 }
 
-void MetadataCrawler::getFields(string className, MDNode *fields) {
+void MetadataCrawler::getFields(const string &className, MDNode *fields) {
     unsigned int n_op = fields->getNumOperands();
     for (int i = 0; i < n_op; i++) {
         if (fields->getOperand(i)) {
@@ -180,13 +178,32 @@ void MetadataCrawler::getFields(string className, MDNode *fields) {
     }
 }
 
-string MetadataCrawler::getFieldName(string structName, int fieldIdx) {
-    if (fieldMap.count(structName) > 0) {
-        if (fieldIdx >= fieldMap[structName].size()) {
-            return "unknown";
-        } else {
-            return fieldMap[structName].at(fieldIdx);
+const string &MetadataCrawler::getFieldName(const string &structName, int fieldIdx) {
+    static const string unknown("unknown");
+    static const string na("NA");
+
+    if (!crawled) {
+        crawl();
+    }
+
+    auto fit = fieldMap.find(structName);
+    if (fit == fieldMap.end()) {
+        auto cit = classMap.find(structName);
+        if (cit == classMap.end()) {
+            return na;
         }
+        for (MDNode *mdn : cit->second) {
+            getFields(structName, cast<MDNode>(mdn->getOperand(10)));
+        }
+        /* Remember classes without fields too, so they are read once */
+        fit = fieldMap.insert(make_pair(structName, vector<string>())).first;
+    }
+
+    if (fit->second.empty()) {
+        return na;
+    }
+    if (fieldIdx < 0 || fieldIdx >= (int)fit->second.size()) {
+        return unknown;
     }
-    return "NA";
+    return fit->second.at(fieldIdx);
 }
@@ -28,37 +28,45 @@ class MDTraversal {
         virtual void traverse(MDNode *) = 0;
 };
 
-class FieldNameTraversal : public MDTraversal {
+/* Collects the typedef and class/struct nodes, in the order they are met */
+class TypeNodeTraversal : public MDTraversal {
     public:
-        FieldNameTraversal(MetadataCrawler *a_mdc) : MDTraversal(a_mdc) {};
-        void traverse(MDNode *); 
-};
-
-class TypedefTraversal : public MDTraversal {
-    public:
-        TypedefTraversal(MetadataCrawler *a_mdc) : MDTraversal(a_mdc) {};
+        TypeNodeTraversal(MetadataCrawler *a_mdc) : MDTraversal(a_mdc) {};
         void traverse(MDNode *);
 };
 
 
+/*
+ * Field names of the module's classes and structs, from the debug
+ * metadata. The metadata is only walked the first time a field name is
+ * asked for, and the fields of a class only resolved when one of them
+ * is, so modules that get no access instrumentation pay nothing.
+ */
 class MetadataCrawler {
     private:
+        Module *module;
+        bool crawled;
         set<MDNode *> visited;
+        void crawl();
         void crawlAllInstructions(Module &m, MDTraversal *mdt);
         void crawlNMD(NamedMDNode *nmd, MDTraversal *mdt);
+        void addTypedef(MDNode *mdn);
+        void addClass(MDNode *mdn);
 
-        TypedefTraversal typedefTraversal;
-        FieldNameTraversal fieldNameTraversal;
+        TypeNodeTraversal typeNodeTraversal;
 
     public:
+        vector<MDNode *> typedefNodes;
+        vector<MDNode *> classNodes;
         map<MDNode *, string> typedefMap;
+        map<string, vector<MDNode *>> classMap;
         map<string, vector<string>> fieldMap;
-        MetadataCrawler() : typedefTraversal(this), fieldNameTraversal(this) {};
+        MetadataCrawler() : module(NULL), crawled(false), typeNodeTraversal(this) {};
 
         void traverseMetadata(MDNode *mdn, MDTraversal *traversal);
         void crawlModule(Module &m);
-        void getFields(string className, MDNode *fields);
-        string getFieldName(string structName, int fieldIdx);
+        void getFields(const string &className, MDNode *fields);
+        const string &getFieldName(const string &structName, int fieldIdx);
 };
 
 #endif
@@ -0,0 +1,146 @@
+#include "RedundantReads.hpp"
+
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/ValueTracking.h"
+
+#include <string.h>
+
+bool RedundantReadFilter::enabled() {
+    const char * val = ::getenv("DIN_ELIM_READS");
+    return (val != 0) && (strcmp(val, "") != 0) && (strcmp(val, "0") != 0);
+}
+
+/*
+ * Allocas whose address never escapes the function can only be
+ * written through the function's own stores, whatever it calls. This
+ * matters at -O0, where there is no real alias analysis and every local
+ * variable lives in an alloca.
+ */
+bool RedundantReadFilter::isLocalObject(const Value *obj) {
+    if (!isa<AllocaInst>(obj)) {
+        return false;
+    }
+    auto it = captured.find(obj);
+    if (it == captured.end()) {
+        it = captured.insert(make_pair(obj,
+                    PointerMayBeCaptured(obj, true, true))).first;
+    }
+    return !it->second;
+}
+
+bool RedundantReadFilter::mayClobber(Instruction *i, LoadInst *li) {
+    if (!i->mayWriteToMemory()) {
+        return false;
+    }
+
+    Value *obj = GetUnderlyingObject(li->getPointerOperand());
+
+    if (StoreInst *si = dyn_cast<StoreInst>(i)) {
+        Value *dst = GetUnderlyingObject(si->getPointerOperand());
+        if (dst != obj && isIdentifiedObject(dst) && isIdentifiedObject(obj)) {
+            return false;
+        }
+    } else if (isa<CallInst>(i) || isa<InvokeInst>(i)) {
+        if (isLocalObject(obj)) {
+            return false;
+        }
+    }
+
+    return (aa->getModRefInfo(i, aa->getLocation(li)) & AliasAnalysis::Mod) != 0;
+}
+
+LoadInst *RedundantReadFilter::findAvailable(AvailableLoads &avail, LoadInst *li) {
+    Value *ptr = li->getPointerOperand()->stripPointerCasts();
+
+    for (LoadInst *prev : avail) {
+        if (prev->getType() != li->getType()) {
+            continue;
+        }
+        if (prev->getPointerOperand()->stripPointerCasts() == ptr) {
+            return prev;
+        }
+        if (aa->alias(aa->getLocation(prev), aa->getLocation(li)) ==
+                AliasAnalysis::MustAlias) {
+            return prev;
+        }
+    }
+    return NULL;
+}
+
+void RedundantReadFilter::scanBlock(BasicBlock *b, AvailableLoads &avail) {
+    for (Instruction &i : *b) {
+        if (LoadInst *li = dyn_cast<LoadInst>(&i)) {
+            /* Volatile and atomic loads are always logged, and
+             * ordered ones may make other threads' writes visible */
+            if (!li->isSimple()) {
+                if (li->isAtomic()) {
+                    avail.clear();
+                }
+                continue;
+            }
+            if (findAvailable(avail, li) != NULL) {
+                redundant.insert(li);
+            } else {
+                avail.push_back(li);
+            }
+            continue;
+        }
+
+        if (!i.mayWriteToMemory()) {
+            continue;
+        }
+        for (auto it = avail.begin(); it != avail.end(); ) {
+            if (mayClobber(&i, *it)) {
+                it = avail.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+}
+
+/*
+ * Walks the dominator tree, the way EarlyCSE does. A block inherits
+ * the loads available at the end of its immediate dominator only if
+ * that is also its single predecessor: otherwise some path into the
+ * block bypasses the dominator's end and may write to the location.
+ */
+size_t RedundantReadFilter::analyzeFunction(Function &f, AliasAnalysis &analysis) {
+    if (f.empty()) {
+        return 0;
+    }
+
+    aa = &analysis;
+    size_t before = redundant.size();
+
+    DominatorTree dt;
+    dt.recalculate(f);
+
+    vector<pair<DomTreeNode *, AvailableLoads> > stack;
+    stack.push_back(make_pair(dt.getRootNode(), AvailableLoads()));
+
+    while (!stack.empty()) {
+        DomTreeNode *node = stack.back().first;
+        AvailableLoads avail;
+        avail.swap(stack.back().second);
+        stack.pop_back();
+
+        BasicBlock *b = node->getBlock();
+        scanBlock(b, avail);
+
+        for (DomTreeNode *child : *node) {
+            if (child->getBlock()->getSinglePredecessor() == b) {
+                stack.push_back(make_pair(child, avail));
+            } else {
+                stack.push_back(make_pair(child, AvailableLoads()));
+            }
+        }
+    }
+
+    captured.clear();
+    return redundant.size() - before;
+}
+
+bool RedundantReadFilter::isRedundant(LoadInst *li) {
+    return redundant.count(li) != 0;
+}
@@ -0,0 +1,47 @@
+#ifndef REDUNDANTREADS_HPP
+#define REDUNDANTREADS_HPP
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace std;
+using namespace llvm;
+
+/*
+ * Finds loads whose access event is redundant: the same location was
+ * already read, with the same type, by a load that dominates this one,
+ * and nothing in between may have written to it. The event of such a
+ * load would log the same address and value as the earlier one.
+ *
+ * Enabled with DIN_ELIM_READS=1.
+ */
+class RedundantReadFilter {
+    private:
+        AliasAnalysis *aa;
+        set<LoadInst *> redundant;
+        map<const Value *, bool> captured;
+
+        typedef vector<LoadInst *> AvailableLoads;
+
+        bool isLocalObject(const Value *obj);
+        bool mayClobber(Instruction *i, LoadInst *li);
+        LoadInst *findAvailable(AvailableLoads &avail, LoadInst *li);
+        void scanBlock(BasicBlock *b, AvailableLoads &avail);
+
+    public:
+        RedundantReadFilter() : aa(NULL) {}
+
+        bool enabled();
+        /* Returns the number of redundant loads found in f */
+        size_t analyzeFunction(Function &f, AliasAnalysis &aa);
+        bool isRedundant(LoadInst *li);
+};
+
+#endif
@@ -0,0 +1,117 @@
+#include "Sampling.hpp"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <string.h>
+#include <vector>
+
+bool SamplingManager::enabled() {
+    const char * val = ::getenv("DIN_SAMPLING");
+    return (val != 0) && (strcmp(val, "") != 0) && (strcmp(val, "0") != 0);
+}
+
+/*
+ * main() and the global constructors set up and flush the trace, so
+ * they always run instrumented. The clean copy is called with the
+ * arguments of the original, which cannot be done for varargs.
+ */
+bool SamplingManager::canSample(Function *f) {
+    if (f->empty() || f->isVarArg()) {
+        return false;
+    }
+    if (f->getName().str().compare("main") == 0 ||
+        f->getName().str().substr(0, 8).compare("_GLOBAL_") == 0) {
+        return false;
+    }
+    for (Argument &a : f->getArgumentList()) {
+        if (a.hasInAllocaAttr()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SamplingManager::isClone(Function *f) {
+    return clones.count(f) != 0;
+}
+
+Function *SamplingManager::cloneFunction(Function *f) {
+    ValueToValueMapTy vmap;
+    Function *clean = CloneFunction(f, vmap, false);
+
+    clean->setName(f->getName() + ".dinamite.clean");
+    clean->setLinkage(GlobalValue::InternalLinkage);
+    f->getParent()->getFunctionList().push_back(clean);
+    clones.insert(clean);
+    return clean;
+}
+
+/*
+ * Make f start with its switch check (toggle, a byte that is non-zero
+ * while f is disabled) and then the sampling check, and tail-call its
+ * clean copy unless both say to run instrumented. Either check can be
+ * left out. Static allocas move to the new entry block so they stay
+ * static, which means f's frame is set up on both paths.
+ *
+ * The clean copy has f's prototype, so the call is musttail and f's
+ * frame is gone before the copy runs, except with byval arguments,
+ * whose copies not every backend can forward; those get a plain tail
+ * call, which is only a hint.
+ */
+void SamplingManager::insertDispatch(Function *f, Function *clean, Function *check,
+                                     Constant *toggle) {
+    BasicBlock *entry = &f->getEntryBlock();
+    LLVMContext &ctx = f->getContext();
+    BasicBlock *skip = BasicBlock::Create(ctx, "dinamite.clean", f, entry);
+    BasicBlock *sample = entry;
+    if (check != NULL) {
+        sample = BasicBlock::Create(ctx, "dinamite.sample", f, &f->front());
+        IRBuilder<> Builder(sample);
+        Value *sampled = Builder.CreateCall(check);
+        Value *cond = Builder.CreateICmpNE(sampled,
+                ConstantInt::get(sampled->getType(), 0));
+        Builder.CreateCondBr(cond, entry, skip);
+    }
+    BasicBlock *dispatch = sample;
+    if (toggle != NULL) {
+        dispatch = BasicBlock::Create(ctx, "dinamite.toggle", f, &f->front());
+        IRBuilder<> Builder(dispatch);
+        /* Flipped by the runtime's control thread */
+        LoadInst *disabled = Builder.CreateLoad(toggle);
+        disabled->setAlignment(1);
+        disabled->setAtomic(Monotonic);
+        Value *cond = Builder.CreateICmpEQ(disabled,
+                ConstantInt::get(disabled->getType(), 0));
+        Builder.CreateCondBr(cond, sample, skip);
+    }
+    Instruction *br = dispatch->getTerminator();
+
+    for (auto it = entry->begin(); it != entry->end(); ) {
+        AllocaInst *ai = dyn_cast<AllocaInst>(it++);
+        if (ai != NULL && isa<Constant>(ai->getArraySize())) {
+            ai->moveBefore(br);
+        }
+    }
+
+    IRBuilder<> Builder(skip);
+    std::vector<Value *> args;
+    for (Argument &a : f->getArgumentList()) {
+        args.push_back(&a);
+    }
+    CallInst *ci = Builder.CreateCall(clean, args);
+    ci->setCallingConv(clean->getCallingConv());
+    ci->setAttributes(clean->getAttributes());
+    bool byval = false;
+    for (Argument &a : f->getArgumentList()) {
+        byval |= a.hasByValAttr();
+    }
+    ci->setTailCallKind(byval ? CallInst::TCK_Tail : CallInst::TCK_MustTail);
+    if (f->getReturnType()->isVoidTy()) {
+        Builder.CreateRetVoid();
+    } else {
+        Builder.CreateRet(ci);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef SAMPLING_HPP
+#define SAMPLING_HPP
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+
+#include <iostream>
+#include <set>
+
+using namespace std;
+using namespace llvm;
+
+/*
+ * Bursty sampling, after Arnold and Ryder: every instrumented function
+ * keeps a clean copy, and a check at its entry (logSampleCheck() in the
+ * runtime) picks which of the two runs. The runtime decides how long
+ * the bursts of instrumented calls are and how often they come.
+ *
+ * The clean copies are also what per-function switches (see
+ * FunctionToggles.hpp) fall back to. Every function that is sampled or
+ * switched is in the binary twice.
+ *
+ * Enabled with DIN_SAMPLING=1.
+ */
+class SamplingManager {
+    private:
+        set<Function *> clones;
+
+    public:
+        bool enabled();
+        bool canSample(Function *f);
+        bool isClone(Function *f);
+        /* Must be called before anything is inserted into f */
+        Function *cloneFunction(Function *f);
+        /* check and toggle may be NULL, not both */
+        void insertDispatch(Function *f, Function *clean, Function *check,
+                            Constant *toggle);
+};
+
+#endif
@@ -5,6 +5,7 @@ using namespace std;
 
 #include <set>
 #include <map>
+#include <unordered_map>
 
 #include "llvm/IR/Function.h"
 #include "llvm/IR/BasicBlock.h"
@@ -13,6 +14,8 @@ using namespace std;
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/Analysis/CFG.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/BitVector.h"
 
 std::string demangle(const char* name) 
 {
@@ -22,6 +25,13 @@ std::string demangle(const char* name)
     return (status == 0) ? res.get() : std::string(name);
 }
 
+std::string getSourceName(const Function *f)
+{
+    StringRef name = f->getName();
+    size_t suffix = name.find(".llvm.");
+    return (suffix == StringRef::npos) ? name.str() : name.substr(0, suffix).str();
+}
+
 void printType(llvm::Type *t) {
     std::string type_str;
     llvm::raw_string_ostream rso(type_str);
@@ -30,107 +40,157 @@ void printType(llvm::Type *t) {
 }
 
 
-// Each basic block has a terminator that can get a list of successors
-// We can form a graph with this and find out if there are any loops
-
-bool checkFunctionLoops(Function &f) {
-    SmallVector< std::pair< const BasicBlock *, const BasicBlock * >, 10 > backedges;
+/*
+ * One walk over the function for all of its size metrics. Source lines
+ * are numbered densely, so the line sets of the longest path search are
+ * bitsets. The search itself is a depth-first walk from the entry: a
+ * block's path is its own lines plus the largest path of its
+ * successors, so paths are computed in post order (reverse RPO), where
+ * every successor comes before the block. A successor still on the
+ * walk's stack is a back edge: it only adds its own lines, and it
+ * means the function has a loop. This gives the same sizes as the old
+ * recursive search, without copying line sets at every edge.
+ */
+FunctionMetrics computeFunctionMetrics(Function &f) {
+    FunctionMetrics fm;
+    fm.irSize = f.size();
+    fm.locSize = 0;
+    fm.pathSize = 0;
+    fm.hasLoops = false;
     if (f.empty()) {
-        return false;
+        return fm;
     }
-    FindFunctionBackedges(f, backedges);
-    if (backedges.size() != 0) {
-        return true;
-    } else {
-        return false;
-    }
-}
 
+    DenseMap<BasicBlock *, unsigned> blockIdx;
+    vector<BasicBlock *> blocks;
+    vector<vector<unsigned> > blockLines;
+    unordered_map<unsigned, unsigned> lineIdx;
 
-
-size_t getFunctionLOCSize(Function &f) {
-    if (f.size() == 0) {
-        return 0;
-    }
-    set<int> lineSet;
     for (BasicBlock &b : f) {
+        blockIdx[&b] = blocks.size();
+        blocks.push_back(&b);
+        blockLines.push_back(vector<unsigned>());
+        vector<unsigned> &lines = blockLines.back();
         for (Instruction &i : b) {
-            int curline = -1;  
-            if (MDNode *N = i.getMetadata("dbg")) {  
+            if (MDNode *N = i.getMetadata("dbg")) {
                 DILocation loc(N);
-                curline = loc.getLineNumber();
-            } 
-            if (curline != -1) {
-                if (lineSet.count(curline) == 0) {
-                    lineSet.insert(curline);
+                auto ins = lineIdx.insert(make_pair(loc.getLineNumber(),
+                                                    (unsigned)lineIdx.size()));
+                lines.push_back(ins.first->second);
+            }
+        }
+    }
+    fm.locSize = lineIdx.size();
+    unsigned nlines = lineIdx.size();
+
+    /* Depth-first walk: post order, and which edges are back edges */
+    unsigned n = blocks.size();
+    vector<char> state(n, 0);    // 0 unseen, 1 on the stack, 2 finished
+    vector<unsigned> postOrder;
+    vector<SmallVector<pair<unsigned, bool>, 2> > succs(n);
+    vector<unsigned> uses(n, 0);  // edges whose source still needs the path
+    vector<pair<unsigned, unsigned> > stack;
+
+    stack.push_back(make_pair(0u, 0u));
+    state[0] = 1;
+    while (!stack.empty()) {
+        unsigned b = stack.back().first;
+        TerminatorInst *ti = blocks[b]->getTerminator();
+        unsigned nsucc = (ti == NULL || isa<ReturnInst>(ti)) ? 0 : ti->getNumSuccessors();
+
+        if (stack.back().second < nsucc) {
+            unsigned s = blockIdx[ti->getSuccessor(stack.back().second++)];
+            if (state[s] == 1) {
+                succs[b].push_back(make_pair(s, true));
+                fm.hasLoops = true;
+            } else {
+                succs[b].push_back(make_pair(s, false));
+                uses[s]++;
+                if (state[s] == 0) {
+                    state[s] = 1;
+                    stack.push_back(make_pair(s, 0u));
                 }
             }
+        } else {
+            state[b] = 2;
+            postOrder.push_back(b);
+            stack.pop_back();
         }
     }
-    return lineSet.size();
-}
 
-set<int> calculateBlock(BasicBlock *block) {
-    set<int> lineSet;
-    for (Instruction &i : *block) {
-        int curline = -1;  
-        if (MDNode *N = i.getMetadata("dbg")) {  
-            DILocation loc(N);
-            curline = loc.getLineNumber();
-        } 
-        if (curline != -1) {
-            if (lineSet.count(curline) == 0) {
-                lineSet.insert(curline);
+    /* A successor's path is moved, not copied, into its last user */
+    vector<BitVector> paths(n);
+    vector<size_t> pathSizes(n, 0);
+    for (unsigned b : postOrder) {
+        TerminatorInst *ti = blocks[b]->getTerminator();
+        if (ti == NULL || isa<ReturnInst>(ti)) {
+            paths[b].resize(nlines);
+            for (unsigned line : blockLines[b]) {
+                paths[b].set(line);
             }
+            pathSizes[b] = paths[b].count();
+            continue;
         }
+
+        /* The first successor with the most lines wins */
+        BitVector best(nlines);
+        size_t bestSize = 0;
+        for (auto &succ : succs[b]) {
+            BitVector p;
+            size_t size = 0;
+            if (succ.second) {
+                p.resize(nlines);
+                for (unsigned line : blockLines[succ.first]) {
+                    p.set(line);
+                }
+                size = p.count();
+            } else {
+                if (--uses[succ.first] == 0) {
+                    p.swap(paths[succ.first]);
+                } else {
+                    p = paths[succ.first];
+                }
+                size = pathSizes[succ.first];
+            }
+            for (unsigned line : blockLines[b]) {
+                if (!p.test(line)) {
+                    p.set(line);
+                    size++;
+                }
+            }
+            if (bestSize < size) {
+                best.swap(p);
+                bestSize = size;
+            }
+        }
+        paths[b].swap(best);
+        pathSizes[b] = bestSize;
     }
-    return lineSet;
-}
+    fm.pathSize = pathSizes[0];
 
-void explorePath(map<BasicBlock *, set<int> > &visits, BasicBlock &currentBlock) {
-
-	/* Return if we already visited this block */
-	if (visits.find(&currentBlock) != visits.end())
-		return;
-
-	set<int> currentBlockLineSet = calculateBlock(&currentBlock);
-
-	/* Update the visits map to reflect the visit to the current block.
-	 * If we are in a loop, we will visit this block again, so we need
-	 * to remember that we already visited it to avoid going into an
-	 * infinite loop.
-	 */
-	visits[&currentBlock] = currentBlockLineSet;
-
-	TerminatorInst *ti = currentBlock.getTerminator();
-	/* Check if this is the leaf node */
-	if (ti == NULL || dyn_cast<ReturnInst>(ti))
-		return;
-
-	set<int> maxLineSet;
-	for (unsigned i = 0; i < ti->getNumSuccessors(); i++) {
-		explorePath(visits, *(ti->getSuccessor(i)));
-		set<int> pLineSet = visits[ti->getSuccessor(i)];
-		pLineSet.insert(currentBlockLineSet.begin(),
-				currentBlockLineSet.end());
-		if (maxLineSet.size() < pLineSet.size()) {
-			maxLineSet = pLineSet;
-		}
-	}
-	visits[&currentBlock] = maxLineSet;
-	return;
+    return fm;
 }
 
-// Cheap way to do this, traverse the basic block graph following terminators
-size_t longestPathSize(Function &f) {
-    if (f.empty()) {
-        return 0;
+const FunctionMetrics &FunctionMetricsCache::get(Function &f) {
+    auto it = metrics.find(&f);
+    if (it != metrics.end()) {
+        return it->second;
     }
-    map<BasicBlock *, set<int> > visits;
-    BasicBlock &entrybb = f.getEntryBlock();
-    explorePath(visits, entrybb);
+    return metrics[&f] = computeFunctionMetrics(f);
+}
+
+void FunctionMetricsCache::clear() {
+    metrics.clear();
+}
 
-    return visits[&entrybb].size();
+bool checkFunctionLoops(Function &f) {
+    return computeFunctionMetrics(f).hasLoops;
 }
 
+size_t getFunctionLOCSize(Function &f) {
+    return computeFunctionMetrics(f).locSize;
+}
 
+size_t longestPathSize(Function &f) {
+    return computeFunctionMetrics(f).pathSize;
+}
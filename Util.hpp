@@ -17,8 +17,37 @@ using namespace llvm;
 
 std::string demangle(const char* name);
 
+/*
+ * The name f has in its source module. ThinLTO renames the local
+ * functions it exports to name.llvm.<module hash>, a name that differs
+ * from the plain build's; IDs and filters use the name without it.
+ */
+std::string getSourceName(const Function *f);
+
 void printType(llvm::Type *t);
 
+/* Size metrics of a function, for the size filter */
+typedef struct _FunctionMetrics {
+    size_t irSize;      /* basic blocks */
+    size_t locSize;     /* distinct source lines */
+    size_t pathSize;    /* distinct source lines on the longest path */
+    bool hasLoops;
+} FunctionMetrics;
+
+/* All the metrics, in one walk over f */
+FunctionMetrics computeFunctionMetrics(Function &f);
+
+/* Metrics of the functions of a module, computed once per function */
+class FunctionMetricsCache {
+    private:
+        map<const Function *, FunctionMetrics> metrics;
+
+    public:
+        const FunctionMetrics &get(Function &f);
+        void clear();
+};
+
+/* Each of these computes all the metrics: prefer FunctionMetricsCache */
 size_t getFunctionLOCSize(llvm::Function &f);
 
 bool checkFunctionLoops(Function &f);
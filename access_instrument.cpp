@@ -13,6 +13,9 @@
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/ADT/APInt.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include <llvm/IRReader/IRReader.h>
 #include <llvm/IR/LLVMContext.h>
@@ -24,6 +27,12 @@
 #include "MetadataCrawler.hpp"
 #include "LogFunctionManager.hpp"
 #include "InstrumentationFilter.hpp"
+#include "RedundantReads.hpp"
+#include "AccessRanges.hpp"
+#include "Sampling.hpp"
+#include "LocalAccesses.hpp"
+#include "FunctionToggles.hpp"
+#include "InstrumentationStats.hpp"
 
 #include <iostream>
 #include <fstream>
@@ -36,7 +45,14 @@
 #define CHECK_TAG(x, tag) (((x) & (tag)) == (tag))
 //#define INST_ALLOC_ONLY 1
 
-#define DEBUG_PRINT 1
+/*
+ * Marks the functions the pass went over, so that a second run, as when
+ * it runs both at compile time and in an LTO backend, leaves them alone
+ */
+#define INSTRUMENTED_ATTR "dinamite-instrumented"
+
+/* Build with -DDEBUG_PRINT to trace every instrumentation decision */
+//#define DEBUG_PRINT 1
 
 using namespace llvm;
 using namespace std;
@@ -59,13 +75,27 @@ namespace {
         MetadataCrawler mdc;
         LogFunctionManager lfm;
         InstrumentationFilter insfilt;
+        RedundantReadFilter rrf;
+        AccessRangeFinder arf;
+        SamplingManager smp;
+        LocalAccessFilter laf;
+        FunctionToggleManager fntoggles;
+        InstrumentationStats stats;
+        FunctionMetricsCache fmc;
+
+        /* Names are built once per type, GEP field, value and function */
+        map<Type *, string> typeNames;
+        map<pair<Type *, long>, string> gepVarNames;
+        map<Value *, string> varNames;  // of currentFunction's values
+        map<Function *, string> demangledNames;
+        map<MDNode *, string> subprogramNames;
 
         set<Value *> argLogSet;
 
         Function *currentFunction;
 
         typedef struct _SourceLoc {
-            int fileId;
+            int64_t fileId;
             int line;
             int col;
         } SourceLoc;
@@ -74,16 +104,23 @@ namespace {
             SourceLoc retval;
             int line = -1;
             int col = -1;
-            int fileid = -1;
+            int64_t fileid = -1;
             StringRef file("");
             StringRef dir("");
             if (MDNode *N = i->getMetadata("dbg")) {  // Here I is an LLVM instruction 
                 DILocation loc(N);                      // DILocation is in DebugInfo.h 
                 line = loc.getLineNumber();
                 col = loc.getColumnNumber();
+                /* The scope is the inlined callee's, if any, so this
+                 * is where the code came from */
                 file = loc.getFilename();
                 dir = loc.getDirectory();
                 fileid = srcmap.getId(dir.str() + "/" + file.str());
+                /* Optimized code: merged or hoisted code has line 0 */
+                if (line == 0) {
+                    line = -1;
+                    col = -1;
+                }
 #ifdef DEBUG_PRINT
                 cerr << dir.str() << " " << file.str() << ":" << line << ":" << col << endl;
 #endif
@@ -104,11 +141,10 @@ namespace {
             return newFn;
         }
 
-        AccessInstrumentationPass() : ModulePass(ID), srcmap("map_sources.json"), typemap("map_types.json"), varmap("map_variables.json"), fnmap("map_functions.json") {}
+        AccessInstrumentationPass() : ModulePass(ID), srcmap(IDSTORE_SOURCES), typemap(IDSTORE_TYPES), varmap(IDSTORE_VARIABLES), fnmap(IDSTORE_FUNCTIONS) {}
 
-        Constant *getConstantFromInt(int val, Type *t) {
-            APInt ai(32, val, true);
-            return Constant::getIntegerValue(t, ai);
+        Constant *getConstantFromInt(int64_t val, Type *t) {
+            return ConstantInt::get(t, val, true);
         }
 
         string getGEPType(GetElementPtrInst *gep) {
@@ -150,7 +186,12 @@ namespace {
             }
         }
 
-        string getValueType(Value *v) {
+        const string &getValueType(Value *v) {
+            auto it = typeNames.find(v->getType());
+            if (it != typeNames.end()) {
+                return it->second;
+            }
+
             std::string t_string;
             llvm::raw_string_ostream rso(t_string);
             v->getType()->print(rso);
@@ -160,14 +201,47 @@ namespace {
                 result = result.substr(8);
             } 
 
-            return result;
+            return typeNames[v->getType()] = result;
         }
 
-        StringRef getGEPVarName(GetElementPtrInst *gep) {
-            unsigned long fieldIndex;
-            if (gep->getNumOperands() < 3) {
-                fieldIndex = -1;
-            } else {
+        const string &getDemangledName(Function *f) {
+            auto it = demangledNames.find(f);
+            if (it != demangledNames.end()) {
+                return it->second;
+            }
+            return demangledNames[f] = demangle(getSourceName(f).c_str());
+        }
+
+        /*
+         * The function whose code v is: normally currentFunction, but
+         * with inlining that can be a callee inlined into it, named by
+         * the debug location of v.
+         */
+        const string &getOriginFunctionName(Value *v) {
+            Instruction *i = dyn_cast<Instruction>(v);
+            MDNode *N = i != NULL ? i->getMetadata("dbg") : NULL;
+            if (N == NULL || !DILocation(N).getOrigLocation()) {
+                return getDemangledName(currentFunction);
+            }
+
+            DISubprogram sp = getDISubprogram(DILocation(N).getScope());
+            if (!sp) {
+                return getDemangledName(currentFunction);
+            }
+            auto it = subprogramNames.find(sp);
+            if (it != subprogramNames.end()) {
+                return it->second;
+            }
+            StringRef name = sp.getLinkageName();
+            if (name.empty()) {
+                return subprogramNames[sp] = sp.getName().str();
+            }
+            return subprogramNames[sp] = demangle(name.str().c_str());
+        }
+
+        const string &getGEPVarName(GetElementPtrInst *gep) {
+            long fieldIndex = -1;
+            if (gep->getNumOperands() >= 3) {
                 Value *fiV = gep->getOperand(2);
                 if (ConstantInt *ciV = dyn_cast<ConstantInt> (fiV)) {
                     fieldIndex = ciV->getSExtValue();
@@ -178,6 +252,12 @@ namespace {
             Value *v_src = gep->getOperand(0);
             Type *t_src = v_src->getType();
 
+            pair<Type *, long> key(t_src, fieldIndex);
+            auto it = gepVarNames.find(key);
+            if (it != gepVarNames.end()) {
+                return it->second;
+            }
+
             string parent;
 
             if (t_src->isPointerTy()) {
@@ -206,7 +286,7 @@ namespace {
                 parent.erase(0, dblcolon+2);
             }
 
-            string fieldName = mdc.getFieldName(parent, fieldIndex);
+            const string &fieldName = mdc.getFieldName(parent, fieldIndex);
             parent.append(".");
             parent.append(fieldName);
 
@@ -215,10 +295,18 @@ namespace {
                 parent.erase(parent.length()-5, parent.length());
             }
 
-            return parent;
+            return gepVarNames[key] = parent;
+        }
+
+        const string &getVarName(Value *v) {
+            auto it = varNames.find(v);
+            if (it != varNames.end()) {
+                return it->second;
+            }
+            return varNames[v] = buildVarName(v);
         }
 
-        string getVarName(Value *v) {
+        string buildVarName(Value *v) {
             if (v->getName().str().compare("this.addr") == 0) {
                 string thisclass(getValueType(v));
                 if (thisclass.find("%class.") == 0) {
@@ -243,7 +331,7 @@ namespace {
                 base.assign("<global>.");
             } else {
                 //return "<function_local>";
-                base = demangle(currentFunction->getName().str().c_str());
+                base = getOriginFunctionName(v);
                 if (base.find("(") == string::npos) {
                     base.append("()");
                 } else {
@@ -267,26 +355,17 @@ namespace {
         }
 
         void instrumentAccess(Instruction *si, char accessType) {
-            int line = -1;
-            int col = -1;
-            int fileid = -1;
-            int tid = -1;
-            int varid = -1;
-            StringRef file("");
-            StringRef dir("");
+            int64_t tid = -1;
+            int64_t varid = -1;
             Function *afunc;
-            if (MDNode *N = si->getMetadata("dbg")) {
-                DILocation loc(N);
-                line = loc.getLineNumber();
-                col = loc.getColumnNumber();
-                file = loc.getFilename();
-                dir = loc.getDirectory();
-                fileid = srcmap.getId(dir.str() + "/" + file.str());
-#ifdef DEBUG_PRINT
-                cerr << dir.str() << " " << file.str() << ":" << line << ":" << col << endl;
-#endif
+            SourceLoc srcLoc = getSourceLoc(si);
+            /* Read probes go right after the load and log the value it
+             * read, rather than loading the location a second time. */
+            BasicBlock::iterator insertionPoint = si;
+            if (accessType == 'r') {
+                insertionPoint++;
             }
-            IRBuilder<> Builder(si);
+            IRBuilder<> Builder(insertionPoint);
             std::vector<Value *> args;
             //		for (auto op = si->op_begin(); op != si->op_end(); op++) {
             {
@@ -294,7 +373,7 @@ namespace {
                 if ((accessType == 'w') || (accessType == 'a')) {
                     accessedValue = si->op_begin()->get();
                 } else {
-                    accessedValue = Builder.CreateLoad(si->op_begin()->get());
+                    accessedValue = si;
                 }
 
 #ifdef DEBUG_PRINT
@@ -358,17 +437,55 @@ namespace {
                     args.push_back(castValue);
 
                     args.push_back(getConstantFromInt(accessType, afunc->getFunctionType()->getParamType(2)));
-                    args.push_back(getConstantFromInt(fileid, afunc->getFunctionType()->getParamType(3)));
-                    args.push_back(getConstantFromInt(line, afunc->getFunctionType()->getParamType(4)));
-                    args.push_back(getConstantFromInt(col, afunc->getFunctionType()->getParamType(5)));
+                    args.push_back(getConstantFromInt(srcLoc.fileId, afunc->getFunctionType()->getParamType(3)));
+                    args.push_back(getConstantFromInt(srcLoc.line, afunc->getFunctionType()->getParamType(4)));
+                    args.push_back(getConstantFromInt(srcLoc.col, afunc->getFunctionType()->getParamType(5)));
                     args.push_back(getConstantFromInt(tid, afunc->getFunctionType()->getParamType(6)));
                     args.push_back(getConstantFromInt(varid, afunc->getFunctionType()->getParamType(7)));
 
                     Builder.CreateCall(afunc, args);
+
+                    char kind[] = {accessType, '\0'};
+                    stats.addProbe(kind, si->getParent());
                 }
             }
         }
 
+        void instrumentRange(AccessRange &r) {
+            BasicBlock *exit = arf.getExitBlock(r);
+            if (exit == NULL) {
+                /* Logged in every iteration instead */
+                arf.uncover(r);
+                return;
+            }
+
+            SourceLoc srcLoc = getSourceLoc(r.access);
+            Value *ptr = (r.access->op_end() - 1)->get();
+            int64_t tid = typemap.getId(getValueType(ptr));
+            int64_t varid = varmap.getId(getVarName(ptr));
+
+            Function *rfunc = lfm.rangeLogFunc;
+            FunctionType *ft = rfunc->getFunctionType();
+            IRBuilder<> Builder(exit->getFirstInsertionPt());
+            std::vector<Value *> args;
+
+            args.push_back(Builder.CreateBitCast(r.base, ft->getParamType(0)));
+            args.push_back(r.stride);
+            args.push_back(r.count);
+            args.push_back(getConstantFromInt(r.size, ft->getParamType(3)));
+            args.push_back(getConstantFromInt(r.accessType, ft->getParamType(4)));
+            args.push_back(getConstantFromInt(srcLoc.fileId, ft->getParamType(5)));
+            args.push_back(getConstantFromInt(srcLoc.line, ft->getParamType(6)));
+            args.push_back(getConstantFromInt(srcLoc.col, ft->getParamType(7)));
+            args.push_back(getConstantFromInt(tid, ft->getParamType(8)));
+            args.push_back(getConstantFromInt(varid, ft->getParamType(9)));
+            Builder.CreateCall(rfunc, args);
+
+            /* Runs once, on the way out of the loop */
+            unsigned depth = stats.getLoopDepth(r.exiting);
+            stats.addProbe("range", depth > 0 ? depth - 1 : 0);
+        }
+
         void instrumentAlloc(CallInst *ci) {
             Function *fn = ci->getCalledFunction();
             if (fn == NULL) {
@@ -399,7 +516,7 @@ namespace {
                 } else {
                     allocType = "void";
                 }
-                int typeId = typemap.getId(allocType);
+                int64_t typeId = typemap.getId(allocType);
 
                 SourceLoc srcLoc = getSourceLoc(ci);
 
@@ -433,11 +550,12 @@ namespace {
                 args.push_back(castAddr);
                 args.push_back(castSize);
                 args.push_back(castNum);
-                args.push_back(getConstantFromInt(typeId, lfm.allocLogFunc->getFunctionType()->getParamType(2)));
-                args.push_back(getConstantFromInt(srcLoc.fileId, lfm.allocLogFunc->getFunctionType()->getParamType(3)));
-                args.push_back(getConstantFromInt(srcLoc.line, lfm.allocLogFunc->getFunctionType()->getParamType(4)));
-                args.push_back(getConstantFromInt(srcLoc.col, lfm.allocLogFunc->getFunctionType()->getParamType(5)));
+                args.push_back(getConstantFromInt(typeId, lfm.allocLogFunc->getFunctionType()->getParamType(3)));
+                args.push_back(getConstantFromInt(srcLoc.fileId, lfm.allocLogFunc->getFunctionType()->getParamType(4)));
+                args.push_back(getConstantFromInt(srcLoc.line, lfm.allocLogFunc->getFunctionType()->getParamType(5)));
+                args.push_back(getConstantFromInt(srcLoc.col, lfm.allocLogFunc->getFunctionType()->getParamType(6)));
                 Builder.CreateCall(lfm.allocLogFunc, args);
+                stats.addProbe("alloc", ci->getParent());
 
             }
 
@@ -473,9 +591,10 @@ namespace {
                         lfunc = lfm.fnEndLogFunc;
                     }
                 }
-            int fnid = fnmap.getId(demangle(f->getName().str().c_str()));
+            int64_t fnid = fnmap.getId(getDemangledName(f));
             args.push_back(getConstantFromInt(fnid, lfunc->getFunctionType()->getParamType(0)));
             Builder.CreateCall(lfunc, args);
+            stats.addProbe("fn", i->getParent());
         }
 
 
@@ -490,6 +609,7 @@ namespace {
             if (f->getName().str().compare("exit") == 0) {
                 args.push_back(getConstantFromInt(-1, lfm.exitLogFunc->getFunctionType()->getParamType(0)));
                 Builder.CreateCall(lfm.exitLogFunc, args);
+                stats.addProbe("fn", ci->getParent());
             }
         }
 
@@ -523,7 +643,7 @@ namespace {
         void queueAndInjectArgsToLog(Function *f) {
             if (f->empty()) { return; }
 
-            string fname = f->getName().str();
+            string fname = getSourceName(f);
 
             Instruction *first = f->getEntryBlock().getFirstInsertionPt();
             IRBuilder<> ArgLoadBuilder(first);
@@ -540,6 +660,17 @@ namespace {
             }
         }
 
+        virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+            AU.addRequired<AliasAnalysis>();
+            AU.addRequired<LoopInfo>();
+            AU.addRequired<ScalarEvolution>();
+        }
+
+        bool isInstrumented(Function &f) {
+            return f.getAttributes().hasAttribute(AttributeSet::FunctionIndex,
+                                                  INSTRUMENTED_ATTR);
+        }
+
         virtual bool runOnModule(Module &m) {
 
             insfilt.loadFilterDataEnv();
@@ -548,28 +679,61 @@ namespace {
                 return false;
             }
 
+            bool pending = false;
+            for (Function &f : m) {
+                if (!f.empty() && !isInstrumented(f)) {
+                    pending = true;
+                    break;
+                }
+            }
+            if (!pending) {
+                return false;
+            }
+
             adm.loadAllocDefs();
             lfm.loadFunctions(&m);
 
-            cerr << "Generating class field maps... ";
+            /* Class field maps are built on first use */
             mdc.crawlModule(m);
 
-            cerr << "done!" << endl;
+            bool elimReads = rrf.enabled();
+            bool accessRanges = arf.enabled();
+            bool sampling = smp.enabled();
+            bool skipLocals = laf.enabled();
+            bool toggles = fntoggles.enabled();
+            bool report = stats.enabled();
+
+            stats.beginModule(m);
+            fmc.clear();
 
             for (Function &f : m) {
                 if (!lfm.isLogFunction(&f)) { // TODO: remove and test, should work
-                    //string fname = demangle(f.getName().str().c_str());
+                    /* Clean copies made for sampling and switches
+                     * stay clean */
+                    if (smp.isClone(&f)) {
+                        continue;
+                    }
+                    if (isInstrumented(f)) {
+                        continue;
+                    }
+                    if (!f.empty()) {
+                        f.addFnAttr(INSTRUMENTED_ATTR);
+                    }
+
+                    string fname = getSourceName(&f);
 
                     size_t fnSize;
 
                     fn_size_metrics metric = insfilt.getFunctionSizeMetric();
+                    const char *metricName = metric == FN_SIZE_LOC ? "LOC" :
+                        metric == FN_SIZE_IR ? "IR" : "LOC_PATH";
 
                     if (metric == FN_SIZE_IR) {
                         fnSize = f.size();
                     } else if (metric == FN_SIZE_LOC) {
-                        fnSize = getFunctionLOCSize(f);
+                        fnSize = fmc.get(f).locSize;
                     } else { /* FN_SIZE_PATH */
-			    fnSize = longestPathSize(f);
+			    fnSize = fmc.get(f).pathSize;
 
 			    /* If the function has loops and the loop
 			     * check is on, we want to keep functions
@@ -578,7 +742,7 @@ namespace {
 			     * a very large number to reflect that
 			     * setting.
 			     */
-			    if (checkFunctionLoops(f) &&
+			    if (fmc.get(f).hasLoops &&
 				insfilt.loopCheckEnabled()) {
 				    fnSize = (size_t) ((uint32_t)~0);
 #ifdef DEBUG_PRINT
@@ -591,29 +755,32 @@ namespace {
 
 #ifdef DEBUG_PRINT
 		    cerr << f.getName().str() << ": " << fnSize
-			 << ", metric is ";
-
-		    if (metric == FN_SIZE_LOC)
-			    cerr << "LOC";
-		    else if (metric == FN_SIZE_IR)
-			    cerr << "IR";
-		    else
-			    cerr << "LOC_PATH";
-		    cerr << endl;
+			 << ", metric is " << metricName << endl;
 #endif
 
-                    if (!insfilt.checkFunctionSize(f.getName().str(), fnSize))
-			    continue;
+                    /* Declarations are left out of the report */
+                    if (report && !f.empty()) {
+                        stats.beginFunction(f, getDemangledName(&f),
+                                            metricName, fnSize);
+                    } else {
+                        stats.endFunction();
+                    }
+
+                    if (!insfilt.checkFunctionSize(fname, fnSize)) {
+                        stats.setDecision("below_minimum_size", false, false, false);
+                        stats.endFunction();
+                        continue;
+                    }
 
                     bool accessFilter = insfilt.checkFunctionFilter(
-			    f.getName().str(), "access");
+			    fname, "access");
                     bool functionFilter = insfilt.checkFunctionFilter(
-			    f.getName().str(), "function");
+			    fname, "function");
                     bool allocFilter = insfilt.checkFunctionFilter(
-			    f.getName().str(), "alloc");
+			    fname, "alloc");
 
 #ifdef DEBUG_PRINT
-		    cerr << "functionFilter for " << f.getName().str() << " is "
+		    cerr << "functionFilter for " << fname << " is "
 			 << functionFilter << ".";
 		    if (functionFilter)
 			    cerr << "Instrumenting...";
@@ -621,7 +788,64 @@ namespace {
 			    cerr << "Not instrumenting...";
 		    cerr << endl;
 #endif
+                    stats.setDecision(functionFilter || accessFilter || allocFilter ||
+                                      f.getName().str().compare("main") == 0 ?
+                                      "instrumented" : "not_selected",
+                                      functionFilter, accessFilter, allocFilter);
+                    if (report && !f.empty()) {
+                        stats.setLoopDepths(getAnalysis<LoopInfo>(f));
+                    }
+
                     currentFunction = &f;
+                    varNames.clear();
+
+                    Function *cleanCopy = NULL;
+                    if ((sampling || toggles) &&
+                        (functionFilter || accessFilter || allocFilter) &&
+                        smp.canSample(&f)) {
+                        cleanCopy = smp.cloneFunction(&f);
+                        if (sampling) {
+                            stats.setSampled();
+                        }
+                    }
+
+                    size_t skippedBefore = laf.getSkipped();
+
+                    /* Runs before anything is inserted into f, so the
+                     * probes' calls do not look like clobbers.
+                     */
+                    if (skipLocals && accessFilter) {
+                        laf.analyzeFunction(f);
+                    }
+
+                    if (elimReads && accessFilter) {
+                        size_t eliminated = rrf.analyzeFunction(f,
+                                getAnalysis<AliasAnalysis>());
+                        stats.setCount("redundant_reads", eliminated);
+#ifdef DEBUG_PRINT
+                        cerr << f.getName().str() << ": eliminated "
+                             << eliminated << " redundant read probes" << endl;
+#endif
+                    }
+
+                    if (accessRanges && accessFilter && !f.empty()) {
+                        /* Each getAnalysis() on f recomputes all of
+                         * them, so ask for ScalarEvolution first */
+                        ScalarEvolution &se = getAnalysis<ScalarEvolution>(f);
+                        LoopInfo &li = getAnalysis<LoopInfo>(f);
+                        size_t summarized = arf.analyzeFunction(f, se, li);
+                        stats.setCount("range_accesses", summarized);
+#ifdef DEBUG_PRINT
+                        cerr << f.getName().str() << ": summarized "
+                             << summarized << " loop accesses as ranges" << endl;
+#endif
+                        /* Backwards, since each call goes to the top of
+                         * its exit block */
+                        vector<AccessRange> &ranges = arf.getRanges();
+                        for (auto it = ranges.rbegin(); it != ranges.rend(); it++) {
+                            instrumentRange(*it);
+                        }
+                    }
 
                     //TODO: fill this with functionality:
                     if (functionFilter) {
@@ -652,6 +876,10 @@ namespace {
 
 #ifndef INST_ALLOC_ONLY
                             bool isArg;
+                            if (accessRanges && arf.isCovered(&i)) {
+                                continue;
+                            }
+
                             if (StoreInst *si = dyn_cast<StoreInst>(&i)) {
 				    /* First check for argument instrumentation,
 				     * and remember the result.
@@ -664,14 +892,16 @@ namespace {
 					     */
 					    if (isArg) {
 						    instrumentAccess(si, 'a');
-					    } else {
+					    } else if (!skipLocals ||
+						       !laf.isLocalAccess(si)) {
 						    instrumentAccess(si, 'w');
 					    }
 				    }
                             }
 
                             if (LoadInst *li = dyn_cast<LoadInst>(&i)) {
-                                if (accessFilter) {
+                                if (accessFilter && !rrf.isRedundant(li) &&
+                                    (!skipLocals || !laf.isLocalAccess(li))) {
                                     instrumentAccess(li, 'r');
                                 }
                             }
@@ -690,35 +920,99 @@ namespace {
 
                     }
 
+                    if (skipLocals && accessFilter) {
+                        stats.setCount("local_accesses",
+                                       laf.getSkipped() - skippedBefore);
+                    }
+
+                    if (cleanCopy != NULL) {
+                        smp.insertDispatch(&f, cleanCopy,
+                                sampling ? lfm.sampleCheckFunc : NULL,
+                                toggles ? fntoggles.getSwitch(&m,
+                                    fnmap.getId(getDemangledName(&f))) : NULL);
+                    }
+
+                    stats.endFunction();
                 }
             }
+#ifdef DEBUG_PRINT
+            if (skipLocals) {
+                cerr << m.getModuleIdentifier() << ": skipped "
+                     << laf.getSkipped()
+                     << " accesses to non-escaping stack slots" << endl;
+            }
+#endif
+
+            lfm.inlineProbeCalls();
+
             srcmap.saveMap();
             typemap.saveMap();
             varmap.saveMap();
             fnmap.saveMap();
 
+            stats.save();
+
             return true;
         }
 
 
         };
 
+        /*
+         * Where the pass runs in an optimized build, with DIN_PLACEMENT:
+         * "early" (the default) instruments the IR before the optimizer,
+         * so every access of the source gets a probe; "late"
+         * instruments the optimized IR, after inlining and mem2reg, so
+         * only the accesses of the code that ships do. At -O0 the pass
+         * runs at EP_EnabledOnOptLevel0 either way.
+         */
+        static bool latePlacement() {
+            static int late = -1;
+            if (late != -1) {
+                return late;
+            }
+
+            const char * val = ::getenv("DIN_PLACEMENT");
+            late = 0;
+            if ((val != 0) && (strcmp(val, "late") == 0)) {
+                late = 1;
+            } else if ((val != 0) && (strcmp(val, "") != 0) &&
+                       (strcmp(val, "early") != 0)) {
+                cerr << "Unknown DIN_PLACEMENT " << val
+                     << ", instrumenting early" << endl;
+            }
+            return late;
+        }
+
         static void registerAccessInstrumentationPass(const llvm::PassManagerBuilder &,
                 llvm::legacy::PassManagerBase &PM) {
             PM.add(new AccessInstrumentationPass());
         }
+
+        static void registerEarlyAccessInstrumentationPass(const llvm::PassManagerBuilder &builder,
+                llvm::legacy::PassManagerBase &PM) {
+            if (!latePlacement()) {
+                registerAccessInstrumentationPass(builder, PM);
+            }
+        }
+
+        static void registerLateAccessInstrumentationPass(const llvm::PassManagerBuilder &builder,
+                llvm::legacy::PassManagerBase &PM) {
+            if (latePlacement()) {
+                registerAccessInstrumentationPass(builder, PM);
+            }
+        }
+
         static llvm::RegisterStandardPasses
             //RegisterMyPass(llvm::PassManagerBuilder::EP_EarlyAsPossible,
             RegisterMyPass(llvm::PassManagerBuilder::EP_EnabledOnOptLevel0,
                     registerAccessInstrumentationPass);
-/*
-        static llvm::RegisterStandardPasses
-            RegisterMyPassOx(llvm::PassManagerBuilder::EP_OptimizerLast,
-                    registerAccessInstrumentationPass);
-*/
 	static llvm::RegisterStandardPasses
 	RegisterMyPassOx(llvm::PassManagerBuilder::EP_ModuleOptimizerEarly,
-			 registerAccessInstrumentationPass);
+			 registerEarlyAccessInstrumentationPass);
+        static llvm::RegisterStandardPasses
+            RegisterMyPassOxLate(llvm::PassManagerBuilder::EP_OptimizerLast,
+                    registerLateAccessInstrumentationPass);
     }
 
     char AccessInstrumentationPass::ID = 0;
@@ -1,58 +1,191 @@
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#define _GNU_SOURCE /* O_DIRECT */
+
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "binaryinstrumentation.h"
+#include "binaryinstrumentation_probes.h"
+#include "dinamite_lz.h"
 #include "dinamite_time.h"
+#include "dinamite_uring.h"
+
+#define BUFFER_SIZE (1 << 20)
+
+/*
+ * Each thread owns several trace buffers. The thread fills one of them
+ * and, when it is full, hands it to the writer thread through a
+ * single-producer/single-consumer ring and picks up an empty buffer
+ * from a second ring that the writer refills. The application thread
+ * therefore only swaps pointers; all file I/O happens on the writer.
+ * The ring size bounds the number of buffers a thread can own.
+ */
+#define DEFAULT_NBUFFERS 4
+#define RING_SIZE 64
+
+/*
+ * With DINAMITE_OUTPUT=mmap the buffers are windows of BUFFER_SIZE bytes
+ * mapped straight from the trace file, each starting with the header of
+ * the block it holds. The file is grown MMAP_EXTENT bytes at a time, and
+ * cut back to its last block when its thread exits, or at process exit
+ * for the threads still running.
+ */
+enum output_modes {
+	OUTPUT_STDIO, OUTPUT_MMAP, OUTPUT_DIRECT
+};
+
+#define MMAP_EXTENT (64 << 20)
+
+/*
+ * With DINAMITE_OUTPUT=direct the trace files are opened with O_DIRECT
+ * and the writer queues full buffers with io_uring, or writes them with
+ * pwrite() where io_uring is not available or DINAMITE_URING=off. The
+ * buffers then hold their block header in front of the records, like
+ * mapped windows, and blocks are padded to DIRECT_ALIGN. A buffer goes
+ * back to its thread only once its write has completed.
+ */
+#define DIRECT_ALIGN 4096
+#define URING_ENTRIES 256
 
-#define likely(x)       __builtin_expect(!!(x), 1)
-#define unlikely(x)     __builtin_expect(!!(x), 0)
+/*
+ * With DINAMITE_CLOCK=tsc the writer refines the TSC calibration this
+ * often, so that blocks written later carry a more accurate rate.
+ */
+#define RECALIBRATE_NS 1000000000ULL
+
+typedef struct _dinamite_ring {
+	dinamite_buffer *slots[RING_SIZE];
+	unsigned int head; /* advanced by the consumer */
+	unsigned int tail; /* advanced by the producer */
+} dinamite_ring;
+
+typedef struct _dinamite_thread {
+	dinamite_buffer *cur;
+	dinamite_ring full;  /* application thread -> writer */
+	dinamite_ring empty; /* writer -> application thread */
+	FILE *out;           /* only touched by the writer */
+	int fd;              /* trace file, mmap and direct modes */
+	off_t next_offset;   /* where the next window is mapped or written */
+	off_t allocated;     /* bytes preallocated in the file */
+	off_t file_end;      /* end of the last sealed block */
+	dinamite_buffer *windows[RING_SIZE]; /* mmap mode: all its buffers */
+	int nwindows;
+	int32_t id;
+	pid_t os_tid;
+	uint64_t stalls;
+	uint64_t stall_ns;
+	unsigned int inflight; /* writes not completed yet, direct mode */
+	bool exited;         /* set once the thread has handed over its last buffer */
+	struct _dinamite_thread *next;
+} dinamite_thread;
+
+/*
+ * Registry of traced threads. New threads are pushed at the head under
+ * registry_mtx; the writer walks the list without taking the lock.
+ */
+static dinamite_thread *thread_list = NULL;
+static pthread_mutex_t registry_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-#define MAX_THREADS 128
+/* Stalls of threads that already exited, protected by registry_mtx */
+static uint64_t exited_stalls = 0;
+static uint64_t exited_stall_ns = 0;
 
-static FILE *out[MAX_THREADS];
-static logentry *entries[MAX_THREADS];
-static int current[MAX_THREADS];
+/*
+ * Buffers of exited threads, handed out again to new threads before
+ * any new buffer is allocated.
+ */
+static dinamite_buffer *free_pool[RING_SIZE * 16];
+static int free_pool_count = 0;
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+__thread dinamite_tls __dinamite_self
+	__attribute__((tls_model("initial-exec")));
+static int nbuffers = DEFAULT_NBUFFERS;
+static int output_mode = OUTPUT_STDIO;
+static int ts_policy = TS_DELTA;
+
+/*
+ * Bursty sampling of functions compiled with DIN_SAMPLING=1: out of
+ * every DINAMITE_SAMPLE_PERIOD entries into such functions, a thread
+ * runs the instrumented copy for DINAMITE_SAMPLE_BURST entries and the
+ * clean copy for the rest. With no period every entry is instrumented.
+ */
+static long sample_period = 0;
+static long sample_burst = 0;
 
-#define BUFFER_SIZE 4 * 4096
+/*
+ * With DINAMITE_COMPRESS=lz the writer compresses every block it writes
+ * out in stdio mode; mapped windows are written in place and stay raw.
+ * The scratch buffer and the counters belong to the writer.
+ */
+static int block_codec = BLOCK_RAW;
+static uint8_t *lz_buffer;
+static uint64_t lz_raw_bytes = 0;
+static uint64_t lz_bytes = 0;
+static uint64_t lz_ns = 0;
+
+/* Direct mode state, owned by the writer */
+static dinamite_uring uring;
+static bool use_uring = false;
+static unsigned int inflight = 0;
+static uint8_t *direct_scratch;
+static long page_size;
 
 static pthread_once_t dinamite_once_control = PTHREAD_ONCE_INIT;
 pthread_key_t tls_key;
 static pthread_mutex_t id_mtx = PTHREAD_MUTEX_INITIALIZER;
-static int next_id = 0;
+static int32_t next_id = 0;
+
+static pthread_t writer_thread;
+static sem_t writer_sem;
+static pthread_mutex_t flush_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long flush_requested = 0;
+static unsigned long flush_completed = 0;
+static bool close_requested = false;
+
+/*
+ * Set by the writer once it has sealed the mapped windows at exit. The
+ * windows handed out after that are anonymous, so whatever threads
+ * still record is dropped.
+ */
+static bool windows_closed = false;
+static pid_t dinamite_pid;
 
 #define DINAMITE_VERBOSE
 
 
-static bool __dinamite_exclude_tid(pid_t tid) {
+static bool __dinamite_exclude_tid(int32_t tid) {
 
 	char *excluded_tids, *token, *orig;
 
-	excluded_tids = malloc(MAX_THREADS);
-	if (excluded_tids == NULL)
-		return false;
-
-	orig = excluded_tids;
 	if (getenv("DINAMITE_EXCLUDE_TID") == NULL) { 
         return false;
     }
-	strncpy(excluded_tids, getenv("DINAMITE_EXCLUDE_TID"),
-		MAX_THREADS-1);
-	if(strlen(excluded_tids) < 1)
+	excluded_tids = strdup(getenv("DINAMITE_EXCLUDE_TID"));
+	if (excluded_tids == NULL)
 		return false;
 
+	orig = excluded_tids;
 	while ((token = strsep(&excluded_tids, ",")) != NULL) {
-		pid_t e_tid = (pid_t)atoi(token);
+		int32_t e_tid = (int32_t)atoi(token);
 		if(e_tid == tid) {
 #ifdef DINAMITE_VERBOSE
 			printf("Excluding tid %d from trace\n", tid);
@@ -65,354 +198,1204 @@ static bool __dinamite_exclude_tid(pid_t tid) {
 	return false;
 }
 
-static void __dinamite_create_key(void) {
+static inline bool
+__dinamite_ring_push(dinamite_ring *r, dinamite_buffer *b) {
 
-	int ret = pthread_key_create(&tls_key, NULL);
+	unsigned int tail = r->tail;
 
-	if(ret) {
-		fprintf(stderr,
-			"pthread_key_create: could not create "
-			"a local-storage key: %s\n", strerror(ret));
-		exit(-1);
-	}
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= RING_SIZE)
+		return false;
+	r->slots[tail % RING_SIZE] = b;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
 }
 
-static inline int __dinamite_get_next_id(void) {
+static inline dinamite_buffer *
+__dinamite_ring_pop(dinamite_ring *r) {
 
-	int ret;
-	pthread_mutex_lock(&id_mtx);
-	ret = next_id++;
-	pthread_mutex_unlock(&id_mtx);
+	dinamite_buffer *b;
+	unsigned int head = r->head;
 
-	return ret;
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	b = r->slots[head % RING_SIZE];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return b;
 }
 
-static inline pid_t __dinamite_gettid(void) {
+static void
+__dinamite_trace_fname(dinamite_thread *t, char *fname) {
 
-	int tid;
+	char *prefix = NULL;
 
-	int ret = pthread_once(&dinamite_once_control, __dinamite_create_key);
+	prefix = getenv("DINAMITE_TRACE_PREFIX");
 
-	if(ret) {
-		fprintf(stderr,
-			"pthread_once: could not create "
-			"a local-storage key: %s\n", strerror(ret));
-		exit(-1);
-	}
+	if(prefix != NULL)
+		snprintf((char*)fname, PATH_MAX-1, "%s/trace.bin.%d", prefix,
+			 t->id);
+	else
+		snprintf((char*)fname, PATH_MAX-1, "trace.bin.%d", t->id);
+}
 
-	if( (tid = (pid_t)(long)pthread_getspecific(tls_key)) == 0) {
-		tid = __dinamite_get_next_id();
-		if(__dinamite_exclude_tid(tid)) {
-			/*
-			 * The user wanted to discard log records for this
-			 * thread ID. Set the tid to an invalid value to
-			 * force log records discarded.
-			 */
-			tid = MAX_THREADS;
-		}
-		pthread_setspecific(tls_key, (void *) (long)tid);
-	}
+static void
+__dinamite_fill_file_header(dinamite_thread *t, dinamite_file_header *hdr,
+			    uint16_t header_size) {
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = DINAMITE_TRACE_MAGIC;
+	hdr->version = DINAMITE_TRACE_VERSION;
+	hdr->header_size = header_size;
+	hdr->thread_id = t->id;
+	hdr->os_tid = t->os_tid;
+	hdr->clock_source = dinamite_clock_source;
+	hdr->ts_policy = ts_policy;
+}
+
+/* Record the current tick to nanosecond conversion in a block header. */
+static void
+__dinamite_stamp_block(dinamite_block_header *bhdr) {
+
+	dinamite_clock_calibration c;
 
-	return tid;
+	dinamite_clock_get_calibration(&c);
+	bhdr->tick_base = c.tick_base;
+	bhdr->ns_base = c.ns_base;
+	bhdr->mult = c.mult;
 }
 
 static inline bool
-__dinamite_ok_tid(pid_t tid, bool quiet) {
+__dinamite_opened_outfile(dinamite_thread *t) {
+
+	char fname[PATH_MAX];
+	dinamite_file_header hdr;
 
-	if(tid > MAX_THREADS -1)
+	__dinamite_trace_fname(t, fname);
+	t->out = fopen(fname, "wb");
+
+	if(t->out == NULL) {
+		fprintf(stderr,
+			"Warning: could not open file %s\n", strerror(errno));
 		return false;
+	}
+
+	__dinamite_fill_file_header(t, &hdr, sizeof(hdr));
+	fwrite(&hdr, sizeof(hdr), 1, t->out);
+	fprintf(stdout,
+		"Opened file %s\n", fname);
 	return true;
 }
 
-static inline bool
-__dinamite_init_buffer(pid_t tid) {
+/*
+ * Open the trace file of a thread in mmap mode. Windows must start at
+ * page boundaries, so the file header takes up the first page.
+ */
+static bool
+__dinamite_open_mmap_file(dinamite_thread *t) {
+
+	char fname[PATH_MAX];
+	dinamite_file_header hdr;
 
-	entries[tid] = (logentry *)malloc(sizeof(logentry) * BUFFER_SIZE);
-	if(entries[tid] == NULL) {
-		fprintf(stderr, "Warning: could not allocate entries buffer "
-			"for thread %d: %s\n", tid, strerror(errno));
+	__dinamite_trace_fname(t, fname);
+	t->fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (t->fd < 0) {
+		fprintf(stderr,
+			"Warning: could not open file %s\n", strerror(errno));
 		return false;
 	}
+
+	__dinamite_fill_file_header(t, &hdr, page_size);
+	if (pwrite(t->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		fprintf(stderr, "Warning: could not write the header of %s: "
+			"%s\n", fname, strerror(errno));
+		close(t->fd);
+		return false;
+	}
+	t->next_offset = page_size;
+	t->file_end = page_size;
+	t->allocated = 0;
+	fprintf(stdout,
+		"Opened file %s\n", fname);
 	return true;
 }
 
-static inline bool
-__dinamite_ok_buffer(pid_t tid) {
+/*
+ * Map the next window of the thread's trace file into b, growing the
+ * file by a whole extent when needed. The block header at the start of
+ * the window is marked open, so a reader can recover the records if the
+ * process dies before the block is sealed.
+ *
+ * If the file cannot be grown or mapped, b gets an anonymous window
+ * instead: the thread keeps running, but what it records there is lost.
+ */
+static void
+__dinamite_map_window(dinamite_thread *t, dinamite_buffer *b) {
+
+	dinamite_block_header *bhdr;
+	void *window = MAP_FAILED;
+	off_t offset = -1;
+	int ret = 0;
+
+	if (__atomic_load_n(&windows_closed, __ATOMIC_ACQUIRE))
+		ret = -1;
+	else if (t->next_offset + BUFFER_SIZE > t->allocated) {
+		ret = posix_fallocate(t->fd, t->allocated, MMAP_EXTENT);
+		if (ret)
+			fprintf(stderr, "Warning: could not grow the trace "
+				"of thread %d: %s\n", t->id, strerror(ret));
+		else
+			t->allocated += MMAP_EXTENT;
+	}
 
-	if(entries[tid] == NULL)
-		return __dinamite_init_buffer(tid);
-	else
-		return true;
+	if (ret == 0) {
+		window = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, t->fd, t->next_offset);
+		if (window == MAP_FAILED)
+			fprintf(stderr, "Warning: could not map the trace of "
+				"thread %d: %s\n", t->id, strerror(errno));
+		else
+			offset = t->next_offset;
+	}
+
+	if (window == MAP_FAILED) {
+		window = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (window == MAP_FAILED) {
+			b->window = b->data = NULL;
+			return;
+		}
+	}
+
+	bhdr = (dinamite_block_header *)window;
+	bhdr->magic = DINAMITE_BLOCK_MAGIC;
+	bhdr->flags = BLOCK_OPEN;
+	bhdr->size = BUFFER_SIZE - sizeof(dinamite_block_header);
+	bhdr->raw_size = bhdr->size;
+	__dinamite_stamp_block(bhdr);
+
+	b->window = (uint8_t *)window;
+	b->offset = offset;
+	b->data = b->window + sizeof(dinamite_block_header);
+	b->size = BUFFER_SIZE - sizeof(dinamite_block_header);
+	b->fill = &bhdr->fill;
+	if (offset >= 0)
+		t->next_offset += BUFFER_SIZE;
 }
 
-static inline bool
-__dinamite_opened_outfile(pid_t tid) {
+/*
+ * Fill in the header of a window with the records committed to it, and
+ * close the block. Windows are sealed in file order, except at exit.
+ */
+static void
+__dinamite_close_block(dinamite_thread *t, dinamite_buffer *b) {
+
+	dinamite_block_header *bhdr = (dinamite_block_header *)b->window;
+	uint64_t fill = __atomic_load_n(b->fill, __ATOMIC_ACQUIRE);
+	size_t used = DINAMITE_FILL_USED(fill);
+	off_t end = b->offset + sizeof(dinamite_block_header) + used;
+
+	bhdr->nrecords = DINAMITE_FILL_RECORDS(fill);
+	bhdr->size = used;
+	bhdr->raw_size = used;
+	bhdr->padding = b->size - used;
+	__atomic_store_n(&bhdr->flags, 0, __ATOMIC_RELEASE);
+	if (used > 0 && b->offset >= 0 && end > t->file_end)
+		t->file_end = end;
+}
 
-	char fname[PATH_MAX];
-	char *prefix = NULL;
+/* Seal a full window and unmap it. */
+static void
+__dinamite_seal_window(dinamite_thread *t, dinamite_buffer *b) {
 
-	if(!__dinamite_ok_tid(tid, true))
-		return false;
+	__dinamite_close_block(t, b);
+	munmap(b->window, BUFFER_SIZE);
+	b->window = NULL;
+	b->data = NULL;
+}
 
-	prefix = getenv("DINAMITE_TRACE_PREFIX");
+/* Drop a buffer the writer frees from the thread's windows */
+static void
+__dinamite_forget_window(dinamite_thread *t, dinamite_buffer *b) {
 
-	if(prefix != NULL)
-		snprintf((char*)fname, PATH_MAX-1, "%s/trace.bin.%d", prefix,
-			 tid);
-	else
-		snprintf((char*)fname, PATH_MAX-1, "trace.bin.%d", tid);
-	out[tid] = fopen(fname, "wb");
+	int i;
 
-	if(out[tid] == NULL) {
+	for (i = 0; i < t->nwindows; i++) {
+		if (t->windows[i] == b) {
+			t->windows[i] = t->windows[--t->nwindows];
+			break;
+		}
+	}
+	free(b);
+}
+
+/*
+ * At exit: seal every window of every thread still running and cut the
+ * files right after their last records, as if the threads had exited.
+ * The threads may still be recording, so each window is replaced with
+ * anonymous memory at the same address rather than unmapped: what the
+ * threads record from now on is dropped, and touching a page past the
+ * new end of the file cannot fault.
+ */
+static void
+__dinamite_close_windows(void) {
+
+	dinamite_thread *t;
+	dinamite_buffer *b;
+	int i;
+
+	__atomic_store_n(&windows_closed, true, __ATOMIC_RELEASE);
+	for (t = __atomic_load_n(&thread_list, __ATOMIC_ACQUIRE); t != NULL;
+	     t = t->next) {
+		for (i = 0; i < t->nwindows; i++) {
+			b = t->windows[i];
+			if (b->window == NULL || b->offset < 0)
+				continue;
+			__dinamite_close_block(t, b);
+			if (mmap(b->window, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+				 0) == MAP_FAILED) {
+				fprintf(stderr, "Warning: could not close the "
+					"trace of thread %d: %s\n", t->id,
+					strerror(errno));
+				break;
+			}
+			b->offset = -1;
+		}
+		if (i == t->nwindows && ftruncate(t->fd, t->file_end) != 0)
+			fprintf(stderr, "Warning: could not truncate the "
+				"trace of thread %d: %s\n", t->id,
+				strerror(errno));
+	}
+}
+
+/*
+ * Open the trace file of a thread in direct mode. O_DIRECT writes must
+ * be aligned, so the file header takes up the first DIRECT_ALIGN bytes.
+ * On filesystems without O_DIRECT the writes go through the page cache.
+ */
+static bool
+__dinamite_open_direct_file(dinamite_thread *t) {
+
+	char fname[PATH_MAX];
+	void *page;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	__dinamite_trace_fname(t, fname);
+	t->fd = open(fname, flags | O_DIRECT, 0644);
+	if (t->fd < 0 && errno == EINVAL) {
+		fprintf(stderr, "Warning: %s does not support O_DIRECT, "
+			"using buffered writes\n", fname);
+		t->fd = open(fname, flags, 0644);
+	}
+	if (t->fd < 0) {
 		fprintf(stderr,
 			"Warning: could not open file %s\n", strerror(errno));
 		return false;
 	}
+
+	if (posix_memalign(&page, DIRECT_ALIGN, DIRECT_ALIGN) != 0) {
+		close(t->fd);
+		return false;
+	}
+	memset(page, 0, DIRECT_ALIGN);
+	__dinamite_fill_file_header(t, (dinamite_file_header *)page,
+				    DIRECT_ALIGN);
+	if (pwrite(t->fd, page, DIRECT_ALIGN, 0) != DIRECT_ALIGN) {
+		fprintf(stderr, "Warning: could not write the header of %s: "
+			"%s\n", fname, strerror(errno));
+		free(page);
+		close(t->fd);
+		return false;
+	}
+	free(page);
+	t->next_offset = DIRECT_ALIGN;
 	fprintf(stdout,
 		"Opened file %s\n", fname);
 	return true;
 }
 
-static inline int
-__dinamite_ok_outfile(pid_t tid) {
+static bool
+__dinamite_alloc_direct_buffer(dinamite_buffer *b) {
 
-	if(!__dinamite_ok_tid(tid, true))
+	void *window;
+
+	if (posix_memalign(&window, DIRECT_ALIGN, BUFFER_SIZE) != 0)
 		return false;
+	b->window = (uint8_t *)window;
+	b->data = b->window + sizeof(dinamite_block_header);
+	b->size = BUFFER_SIZE - sizeof(dinamite_block_header);
+	return true;
+}
 
-	if(out[tid] == NULL)
-		return __dinamite_opened_outfile(tid);
-	else return true;
+static void
+__dinamite_free_buffer(dinamite_buffer *b) {
+
+	free(output_mode == OUTPUT_DIRECT ? b->window : b->data);
+	free(b);
+}
+
+/*
+ * Fill in the header of a block of `size' bytes of records at data,
+ * which directly follow the header, and pad the block to DIRECT_ALIGN.
+ * Returns the length of the block.
+ */
+static size_t
+__dinamite_direct_block(dinamite_block_header *bhdr, uint8_t *data,
+			size_t size, uint32_t nrecords, uint32_t flags,
+			uint64_t ts_base) {
+
+	size_t len = (sizeof(*bhdr) + size + DIRECT_ALIGN - 1) &
+		~(size_t)(DIRECT_ALIGN - 1);
+
+	memset(bhdr, 0, sizeof(*bhdr));
+	bhdr->magic = DINAMITE_BLOCK_MAGIC;
+	bhdr->flags = flags;
+	bhdr->size = size;
+	bhdr->raw_size = size;
+	bhdr->padding = len - sizeof(*bhdr) - size;
+	bhdr->nrecords = nrecords;
+	bhdr->codec = BLOCK_RAW;
+	bhdr->ts_base = ts_base;
+	__dinamite_stamp_block(bhdr);
+	memset(data + size, 0, bhdr->padding);
+	return len;
+}
+
+static void
+__dinamite_direct_pwrite(dinamite_thread *t, const uint8_t *buf, size_t len,
+			 off_t off) {
+
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pwrite(t->fd, buf, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			fprintf(stderr, "Warning: could not write the trace of "
+				"thread %d: %s\n", t->id,
+				ret < 0 ? strerror(errno) : "short write");
+			return;
+		}
+		buf += ret;
+		len -= ret;
+		off += ret;
+	}
 }
 
-static
-void insertOrWrite(logentry *le) {
+/*
+ * Write whatever part of the buffer the writer has not seen yet as one
+ * block, synchronously and through the scratch buffer, since the owning
+ * thread may still be appending to it. This is how partially filled
+ * buffers are flushed in direct mode, and how the rest of such a buffer
+ * is written once it is full.
+ */
+static void
+__dinamite_write_direct_copy(dinamite_thread *t, dinamite_buffer *b) {
+
+	dinamite_block_header *bhdr = (dinamite_block_header *)direct_scratch;
+	uint8_t *data = direct_scratch + sizeof(dinamite_block_header);
+	uint64_t fill = __atomic_load_n(b->fill, __ATOMIC_ACQUIRE);
+	size_t used = DINAMITE_FILL_USED(fill);
+	uint32_t nrecords = DINAMITE_FILL_RECORDS(fill);
+	size_t len;
 
-	pid_t tid = __dinamite_gettid();
-	if(!__dinamite_ok_tid(tid, true) || !__dinamite_ok_buffer(tid))
+	if (used <= b->written)
 		return;
+	memcpy(data, b->data + b->written, used - b->written);
+	len = __dinamite_direct_block(bhdr, data, used - b->written,
+				      nrecords - b->nwritten,
+				      b->written > 0 ? BLOCK_CONTINUED : 0,
+				      b->ts_base);
+	__dinamite_direct_pwrite(t, direct_scratch, len, t->next_offset);
+	t->next_offset += len;
+	b->written = used;
+	b->nwritten = nrecords;
+}
+
+/* Reset a buffer the writer is done with and give it back to its thread */
+static void
+__dinamite_recycle_buffer(dinamite_thread *t, dinamite_buffer *b) {
+
+	b->written = 0;
+	b->nwritten = 0;
+	*b->fill = 0;
+	__dinamite_ring_push(&t->empty, b);
+}
+
+static void
+__dinamite_submit_writes(void) {
+
+	if (use_uring && dinamite_uring_submit(&uring) != 0)
+		fprintf(stderr, "Warning: io_uring_enter: %s\n",
+			strerror(errno));
+}
+
+/*
+ * Submit the queued writes and collect the completed ones, waiting for
+ * at least one completion if wait is set. Failed or short writes are
+ * retried synchronously.
+ */
+static void
+__dinamite_reap_writes(bool wait) {
+
+	dinamite_block_header *bhdr;
+	dinamite_buffer *b;
+	dinamite_thread *t;
+	void *data;
+	size_t len, done;
+	int res;
 
-	if (current[tid] >= BUFFER_SIZE) {
-		if(__dinamite_ok_outfile(tid)) {
-			fwrite(entries[tid], sizeof(logentry), BUFFER_SIZE,
-			       out[tid]);
+	if (!use_uring)
+		return;
+	__dinamite_submit_writes();
+
+	while (dinamite_uring_reap(&uring, wait, &data, &res)) {
+		wait = false;
+		b = (dinamite_buffer *)data;
+		t = b->owner;
+		bhdr = (dinamite_block_header *)b->window;
+		len = sizeof(*bhdr) + bhdr->size + bhdr->padding;
+		if (res != (int)len) {
+			done = res > 0 ? res : 0;
+			__dinamite_direct_pwrite(t, b->window + done,
+						 len - done, b->offset + done);
 		}
-		current[tid] = 0;
-	}
-	entries[tid][current[tid]++] = *le;
-}
-
-void fillFnLog(fnlog *fnl, char fn_event_type, int functionId) {
-	fnl->thread_id = __dinamite_gettid();
-	fnl->fn_event_type = fn_event_type;
-	fnl->function_id = functionId;
-	fnl->fn_timestamp = (uint64_t) dinamite_time_nanoseconds();
-}
-
-void fillAccessLog(accesslog *acl, void *ptr, char value_type,
-		   value_store value, int type, int file, int line,
-		   int col, int typeId, int varId) {
-	acl->thread_id = __dinamite_gettid();
-	acl->ptr = ptr;
-	acl->value_type = value_type;
-	acl->value = value;
-	acl->type = type;
-	acl->file = file;
-	acl->line = line;
-	acl->col = col;
-	acl->typeId = typeId;
-	acl->varId = varId;
-	acl->ac_timestamp = (uint64_t) dinamite_time_nanoseconds();
-}
-
-void fillAllocLog(alloclog *all, void *addr, uint64_t size, uint64_t num,
-		  int type, int file, int line, int col) {
-	all->thread_id = __dinamite_gettid();
-	all->addr = addr;
-	all->size = size;
-	all->num = num;
-	all->type = type;
-	all->file = file;
-	all->line = line;
-	all->col = col;
-	all->al_timestamp = (uint64_t) dinamite_time_nanoseconds();
+		t->inflight--;
+		inflight--;
+		__dinamite_recycle_buffer(t, b);
+	}
 }
 
-/* Open a per-thread log file. */
+/*
+ * Write out a full buffer in direct mode. Returns true if the write was
+ * queued; the buffer then goes back to its thread on completion.
+ */
+static bool
+__dinamite_submit_buffer(dinamite_thread *t, dinamite_buffer *b) {
 
-void logInit(int functionId) {
+	uint64_t fill = __atomic_load_n(b->fill, __ATOMIC_ACQUIRE);
+	size_t len;
 
-	int ret = pthread_once(&dinamite_once_control, __dinamite_create_key);
+	if (b->written > 0) {
+		__dinamite_write_direct_copy(t, b);
+		return false;
+	}
+	if (DINAMITE_FILL_USED(fill) == 0)
+		return false;
 
-	if(ret) {
-		fprintf(stderr,
-			"pthread_once: could not create "
-			"a local-storage key: %s\n", strerror(ret));
-		exit(-1);
+	len = __dinamite_direct_block((dinamite_block_header *)b->window,
+				      b->data, DINAMITE_FILL_USED(fill),
+				      DINAMITE_FILL_RECORDS(fill), 0,
+				      b->ts_base);
+	b->offset = t->next_offset;
+	t->next_offset += len;
+
+	if (!use_uring) {
+		__dinamite_direct_pwrite(t, b->window, len, b->offset);
+		return false;
 	}
+	while (dinamite_uring_write(&uring, t->fd, b->window, len, b->offset,
+				    b) != 0)
+		__dinamite_reap_writes(true);
+	t->inflight++;
+	inflight++;
+	return true;
 }
 
-void logExit(int functionId) {
+static inline int
+__dinamite_ok_outfile(dinamite_thread *t) {
 
-	int tid;
-	for(tid = 0; tid < MAX_THREADS; tid++) {
-		if (entries[tid] && current[tid] > 0) {
-			if(__dinamite_ok_outfile(tid)) {
-				fwrite(entries[tid], sizeof(logentry),
-				       current[tid],
-				       out[tid]);
-				fflush(out[tid]);
-				fclose(out[tid]);
-				out[tid] = NULL;
+	if(t->out == NULL)
+		return __dinamite_opened_outfile(t);
+	else return true;
+}
+
+/*
+ * Write out whatever part of the buffer the writer has not seen yet as
+ * one block. The owning thread may still be appending to a buffer we
+ * are asked to flush, so only the records published before we looked
+ * are written, and the rest of the buffer later becomes a block that
+ * continues the delta coding of this one.
+ */
+static void
+__dinamite_write_buffer(dinamite_thread *t, dinamite_buffer *b) {
+
+	dinamite_block_header bhdr;
+	uint64_t fill = __atomic_load_n(b->fill, __ATOMIC_ACQUIRE);
+	size_t used = DINAMITE_FILL_USED(fill);
+	uint32_t nrecords = DINAMITE_FILL_RECORDS(fill);
+	uint8_t *data = b->data + b->written;
+	size_t size = used - b->written, lz_size = 0;
+	uint64_t start;
+
+	if (used <= b->written)
+		return;
+	if (__dinamite_ok_outfile(t)) {
+		memset(&bhdr, 0, sizeof(bhdr));
+		bhdr.magic = DINAMITE_BLOCK_MAGIC;
+		bhdr.flags = b->written > 0 ? BLOCK_CONTINUED : 0;
+		bhdr.codec = BLOCK_RAW;
+		bhdr.raw_size = size;
+		bhdr.padding = 0;
+		bhdr.nrecords = nrecords - b->nwritten;
+		bhdr.ts_base = b->ts_base;
+		__dinamite_stamp_block(&bhdr);
+
+		if (block_codec == BLOCK_LZ) {
+			start = dinamite_time_nanoseconds();
+			lz_size = dinamite_lz_compress(data, size, lz_buffer,
+						       DINAMITE_LZ_BOUND(
+							       BUFFER_SIZE));
+			lz_ns += dinamite_time_nanoseconds() - start;
+			lz_raw_bytes += size;
+			/* Keep blocks that do not shrink as they are */
+			if (lz_size > 0 && lz_size < size) {
+				bhdr.codec = BLOCK_LZ;
+				data = lz_buffer;
+				size = lz_size;
 			}
+			lz_bytes += size;
 		}
+
+		bhdr.size = size;
+		fwrite(&bhdr, sizeof(bhdr), 1, t->out);
+		fwrite(data, 1, size, t->out);
 	}
+	b->written = used;
+	b->nwritten = nrecords;
 }
 
+/*
+ * Called by the writer once an exited thread's buffers are all written:
+ * close its file, give its buffers to the free pool and drop it from
+ * the registry.
+ */
+static void
+__dinamite_retire_thread(dinamite_thread *t) {
+
+	dinamite_thread **prev;
+	dinamite_buffer *b;
+
+	if (t->out != NULL) {
+		fclose(t->out);
+		t->out = NULL;
+	}
+
+	if (output_mode == OUTPUT_MMAP) {
+		/*
+		 * Windows are mapped in the order they are used, so all the
+		 * ones still empty lie past the last sealed block.
+		 */
+		while ((b = __dinamite_ring_pop(&t->empty)) != NULL) {
+			if (b->window != NULL)
+				munmap(b->window, BUFFER_SIZE);
+			free(b);
+		}
+		if (ftruncate(t->fd, t->file_end) != 0)
+			fprintf(stderr, "Warning: could not truncate the "
+				"trace of thread %d: %s\n", t->id,
+				strerror(errno));
+		close(t->fd);
+	}
+	if (output_mode == OUTPUT_DIRECT)
+		close(t->fd);
+
+	pthread_mutex_lock(&pool_mtx);
+	while ((b = __dinamite_ring_pop(&t->empty)) != NULL) {
+		if (free_pool_count < (int)(sizeof(free_pool) /
+					    sizeof(free_pool[0]))) {
+			free_pool[free_pool_count++] = b;
+		} else {
+			__dinamite_free_buffer(b);
+		}
+	}
+	pthread_mutex_unlock(&pool_mtx);
+
+	pthread_mutex_lock(&registry_mtx);
+	for (prev = &thread_list; *prev != NULL; prev = &(*prev)->next) {
+		if (*prev == t) {
+			__atomic_store_n(prev, t->next, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+	exited_stalls += t->stalls;
+	exited_stall_ns += t->stall_ns;
+	pthread_mutex_unlock(&registry_mtx);
 
-void logFnBegin(int functionId) {
-    logentry le;
-    le.entry_type = LOG_FN;
-    fillFnLog(&(le.entry.fn), FN_BEGIN, functionId);
-    insertOrWrite(&le);
+	free(t);
 }
 
-void logFnEnd(int functionId) {
-    logentry le;
-    le.entry_type = LOG_FN;
-    fillFnLog(&(le.entry.fn), FN_END, functionId);
-    insertOrWrite(&le);
+static void
+__dinamite_drain_thread(dinamite_thread *t) {
+
+	dinamite_buffer *b;
+
+	while ((b = __dinamite_ring_pop(&t->full)) != NULL) {
+		if (output_mode == OUTPUT_MMAP) {
+			__dinamite_seal_window(t, b);
+			/*
+			 * An exited thread will not need another window. If
+			 * no window can be mapped at all, the buffer cannot
+			 * go back to the thread; the thread will then stall.
+			 */
+			if (__atomic_load_n(&t->exited, __ATOMIC_ACQUIRE)) {
+				__dinamite_forget_window(t, b);
+				continue;
+			}
+			__dinamite_map_window(t, b);
+			if (b->data == NULL) {
+				__dinamite_forget_window(t, b);
+				continue;
+			}
+		} else if (output_mode == OUTPUT_DIRECT) {
+			if (__dinamite_submit_buffer(t, b))
+				continue;
+		} else {
+			__dinamite_write_buffer(t, b);
+		}
+		__dinamite_recycle_buffer(t, b);
+	}
 }
 
-void logAlloc(void *addr, uint64_t size, uint64_t num, int type, int file,
-	      int line, int col) {
-    logentry le;
-    le.entry_type = LOG_ALLOC;
-    fillAllocLog(&(le.entry.alloc), addr, size, num, type, file, line, col);
-    insertOrWrite(&le);
+static void *
+__dinamite_writer(void *arg) {
+
+	dinamite_thread *t, *next;
+	unsigned long flush;
+	bool exited, close_windows;
+	struct timespec deadline;
+	uint64_t next_calibration = dinamite_time_nanoseconds() +
+		RECALIBRATE_NS;
+
+	for (;;) {
+		/*
+		 * With writes in flight and nothing else to do, wait for
+		 * a write to complete: threads may be waiting for the
+		 * buffer to come back.
+		 */
+		if (inflight > 0) {
+			if (sem_trywait(&writer_sem) != 0)
+				__dinamite_reap_writes(true);
+		} else if (dinamite_clock_source == DINAMITE_CLOCK_TSC) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += RECALIBRATE_NS / 1000000000ULL;
+			while (sem_timedwait(&writer_sem, &deadline) != 0 &&
+			       errno == EINTR)
+				;
+		} else {
+			while (sem_wait(&writer_sem) != 0 && errno == EINTR)
+				;
+		}
+		if (dinamite_clock_source == DINAMITE_CLOCK_TSC &&
+		    dinamite_time_nanoseconds() >= next_calibration) {
+			dinamite_clock_recalibrate();
+			next_calibration = dinamite_time_nanoseconds() +
+				RECALIBRATE_NS;
+		}
+
+		/*
+		 * Look at flush requests before draining, so that the
+		 * buffers handed over before the request are all drained
+		 * by this pass.
+		 */
+		pthread_mutex_lock(&flush_mtx);
+		flush = flush_requested;
+		close_windows = close_requested;
+		pthread_mutex_unlock(&flush_mtx);
+
+		__dinamite_reap_writes(false);
+		for (t = __atomic_load_n(&thread_list, __ATOMIC_ACQUIRE);
+		     t != NULL; t = next) {
+			next = t->next;
+			exited = __atomic_load_n(&t->exited, __ATOMIC_ACQUIRE);
+			__dinamite_drain_thread(t);
+			if (exited && t->inflight == 0)
+				__dinamite_retire_thread(t);
+		}
+		__dinamite_submit_writes();
+
+		if (flush == flush_completed)
+			continue;
+
+		/*
+		 * Someone is waiting for everything recorded so far to
+		 * reach the files, including partially filled buffers.
+		 * Mapped windows are already part of the files, and their
+		 * headers hold what was committed to them; they are only
+		 * sealed at exit.
+		 */
+		if (output_mode == OUTPUT_MMAP && close_windows &&
+		    !windows_closed)
+			__dinamite_close_windows();
+		for (t = __atomic_load_n(&thread_list, __ATOMIC_ACQUIRE);
+		     t != NULL && output_mode != OUTPUT_MMAP; t = t->next) {
+			dinamite_buffer *b = __atomic_load_n(&t->cur,
+							     __ATOMIC_ACQUIRE);
+			if (b != NULL && output_mode == OUTPUT_DIRECT)
+				__dinamite_write_direct_copy(t, b);
+			else if (b != NULL)
+				__dinamite_write_buffer(t, b);
+			if (t->out != NULL)
+				fflush(t->out);
+		}
+		while (inflight > 0)
+			__dinamite_reap_writes(true);
+
+		pthread_mutex_lock(&flush_mtx);
+		flush_completed = flush;
+		pthread_cond_broadcast(&flush_cond);
+		pthread_mutex_unlock(&flush_mtx);
+	}
+	return NULL;
 }
 
-void logAccessPtr(void *ptr, void *value, int type, int file, int line, int col,
-		  int typeId, int varId) {
+static void __dinamite_thread_exit(void *arg);
+static void __dinamite_exit(void);
+
+static void __dinamite_create_key(void) {
+
+	char *env;
+	int ret = pthread_key_create(&tls_key, __dinamite_thread_exit);
+
+	if(ret) {
+		fprintf(stderr,
+			"pthread_key_create: could not create "
+			"a local-storage key: %s\n", strerror(ret));
+		exit(-1);
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	env = getenv("DINAMITE_OUTPUT");
+	if (env != NULL) {
+		if (strcmp(env, "mmap") == 0)
+			output_mode = OUTPUT_MMAP;
+		else if (strcmp(env, "direct") == 0)
+			output_mode = OUTPUT_DIRECT;
+		else if (strcmp(env, "stdio") != 0)
+			fprintf(stderr, "Warning: unknown DINAMITE_OUTPUT %s, "
+				"using stdio\n", env);
+	}
+
+	env = getenv("DINAMITE_CLOCK");
+	if (env != NULL) {
+		if (strcmp(env, "tsc") == 0)
+			dinamite_clock_init(DINAMITE_CLOCK_TSC);
+		else if (strcmp(env, "monotonic") != 0)
+			fprintf(stderr, "Warning: unknown DINAMITE_CLOCK %s, "
+				"using monotonic\n", env);
+	}
+
+	env = getenv("DINAMITE_TIMESTAMPS");
+	if (env != NULL) {
+		if (strcmp(env, "coarse") == 0)
+			ts_policy = TS_COARSE;
+		else if (strcmp(env, "delta") != 0)
+			fprintf(stderr, "Warning: unknown DINAMITE_TIMESTAMPS "
+				"%s, using delta\n", env);
+	}
+
+	if (output_mode == OUTPUT_DIRECT) {
+		if (posix_memalign((void **)&direct_scratch, DIRECT_ALIGN,
+				   BUFFER_SIZE) != 0) {
+			fprintf(stderr, "Warning: could not allocate the "
+				"direct I/O buffer, using stdio\n");
+			output_mode = OUTPUT_STDIO;
+		}
+		env = getenv("DINAMITE_URING");
+		if (output_mode == OUTPUT_DIRECT &&
+		    (env == NULL || strcmp(env, "off") != 0)) {
+			use_uring = dinamite_uring_init(&uring,
+							URING_ENTRIES) == 0;
+			if (!use_uring)
+				fprintf(stderr, "Warning: io_uring is not "
+					"available (%s), writing with "
+					"pwrite\n", strerror(errno));
+		}
+	}
+
+	env = getenv("DINAMITE_COMPRESS");
+	if (env != NULL) {
+		if (strcmp(env, "lz") == 0)
+			block_codec = BLOCK_LZ;
+		else if (strcmp(env, "none") != 0)
+			fprintf(stderr, "Warning: unknown DINAMITE_COMPRESS %s, "
+				"not compressing\n", env);
+	}
+	if (block_codec == BLOCK_LZ && output_mode != OUTPUT_STDIO) {
+		fprintf(stderr, "Warning: DINAMITE_COMPRESS needs "
+			"DINAMITE_OUTPUT=stdio, not compressing\n");
+		block_codec = BLOCK_RAW;
+	}
+	if (block_codec == BLOCK_LZ &&
+	    (lz_buffer = malloc(DINAMITE_LZ_BOUND(BUFFER_SIZE))) == NULL) {
+		fprintf(stderr, "Warning: could not allocate the compression "
+			"buffer, not compressing\n");
+		block_codec = BLOCK_RAW;
+	}
 
-    logentry le;
-    le.entry_type = LOG_ACCESS;
-    value_store vs;
-    vs.ptr = value;
-    fillAccessLog(&(le.entry.access), ptr, PTR, vs, type, file, line, col,
-		  typeId, varId);
-    insertOrWrite(&le);
+	env = getenv("DINAMITE_SAMPLE_PERIOD");
+	if (env != NULL && (sample_period = atol(env)) > 0) {
+		env = getenv("DINAMITE_SAMPLE_BURST");
+		sample_burst = env != NULL ? atol(env) : sample_period / 100;
+		if (sample_burst < 1)
+			sample_burst = 1;
+		if (sample_burst > sample_period)
+			sample_burst = sample_period;
+	} else
+		sample_period = 0;
+
+	env = getenv("DINAMITE_NBUFFERS");
+	if (env != NULL) {
+		nbuffers = atoi(env);
+		if (nbuffers < 2)
+			nbuffers = 2;
+		if (nbuffers > RING_SIZE)
+			nbuffers = RING_SIZE;
+	}
 
+	if (sem_init(&writer_sem, 0, 0) != 0) {
+		fprintf(stderr, "sem_init: could not initialize the "
+			"writer semaphore: %s\n", strerror(errno));
+		exit(-1);
+	}
+	ret = pthread_create(&writer_thread, NULL, __dinamite_writer, NULL);
+	if(ret) {
+		fprintf(stderr, "pthread_create: could not start "
+			"the trace writer: %s\n", strerror(ret));
+		exit(-1);
+	}
+
+	/* Threads still running at exit never seal their windows */
+	if (output_mode == OUTPUT_MMAP) {
+		dinamite_pid = getpid();
+		atexit(__dinamite_exit);
+	}
 }
 
-/* This function logs an access when we are sure that what we are acccessing is
- * a null-terminated string. A typical use-case is when we print a string passed
- * as an argument to the tracepoint function. Using this function when we are
- * not sure whether the address points to a null-terminated string is unsafe,
- * because we may crash when we try to print it later.
- *
- * Another crucial assumption we are making is that the strings being accessed
- * are static. Here is the reason: To avoid the runtime overhead associated
- * with string printing, this function simply stores the pointer when called,
- * and at the very end of the program goes over the pointers and prints them.
- * Here we are assuming that the pointers accessed earlier in the program are
- * still valid at the end of the program and that they are still pointing to the
- * same values as they did when they were actually accessed. This will be true
- * for static strings, but may not be true for dynamic strings. So this function
- * is not safe to use with dynamically allocated strings.
- */
-void logAccessStaticString(void *ptr, void *value, int type, int file, int line,
-			   int col, int typeId, int varId) {
+static inline int32_t __dinamite_get_next_id(void) {
+
+	int32_t ret;
+	pthread_mutex_lock(&id_mtx);
+	ret = next_id++;
+	pthread_mutex_unlock(&id_mtx);
 
-    logentry le;
-    le.entry_type = LOG_ACCESS;
-    value_store vs;
-    vs.ptr = value;
-    fillAccessLog(&(le.entry.access), ptr, PTR, vs, type, file, line, col,
-		  typeId, varId);
-    insertOrWrite(&le);
+	return ret;
 }
 
-void logAccessI8(void *ptr, uint8_t value, int type, int file, int line,
-		 int col, int typeId, int varId) {
-    logentry le;
-    le.entry_type = LOG_ACCESS;
-    value_store vs;
-    vs.i8 = value;
-    fillAccessLog(&(le.entry.access), ptr, I8, vs, type, file, line, col,
-		  typeId, varId);
-    insertOrWrite(&le);
+static inline bool
+__dinamite_init_buffer(dinamite_thread *t) {
+
+	dinamite_buffer *b;
+	int i;
 
+	if (output_mode == OUTPUT_MMAP && !__dinamite_open_mmap_file(t))
+		return false;
+	if (output_mode == OUTPUT_DIRECT && !__dinamite_open_direct_file(t))
+		return false;
+
+	for (i = 0; i < nbuffers; i++) {
+		b = NULL;
+		if (output_mode != OUTPUT_MMAP) {
+			pthread_mutex_lock(&pool_mtx);
+			if (free_pool_count > 0)
+				b = free_pool[--free_pool_count];
+			pthread_mutex_unlock(&pool_mtx);
+		}
+
+		if (b == NULL) {
+			b = (dinamite_buffer *)calloc(1,
+						      sizeof(dinamite_buffer));
+			if (b != NULL)
+				b->fill = &b->own_fill;
+			if (b != NULL && output_mode == OUTPUT_MMAP) {
+				__dinamite_map_window(t, b);
+			} else if (b != NULL && output_mode == OUTPUT_DIRECT) {
+				__dinamite_alloc_direct_buffer(b);
+			} else if (b != NULL) {
+				b->data = (uint8_t *)malloc(BUFFER_SIZE);
+				b->size = BUFFER_SIZE;
+			}
+		}
+		if (b == NULL || b->data == NULL) {
+			fprintf(stderr, "Warning: could not allocate entries "
+				"buffer for thread %d: %s\n", t->id,
+				strerror(errno));
+			free(b);
+			break;
+		}
+		b->owner = t;
+		if (output_mode == OUTPUT_MMAP)
+			t->windows[t->nwindows++] = b;
+		if (i > 0)
+			__dinamite_ring_push(&t->empty, b);
+		else
+			__atomic_store_n(&t->cur, b, __ATOMIC_RELEASE);
+	}
+
+	if (t->cur == NULL && output_mode != OUTPUT_STDIO)
+		close(t->fd);
+	return t->cur != NULL;
+}
+
+/*
+ * Point the thread's cursor at the start of the given buffer, and take
+ * the timestamp the records of the buffer are deltas against. A mapped
+ * window gets it in its block header right away.
+ */
+static inline void
+__dinamite_use_buffer(dinamite_tls *self, dinamite_buffer *b) {
+
+	self->cur = b;
+	self->pos = b->data;
+	self->end = b->data + b->size - DINAMITE_MAX_RECORD;
+	self->prev_ts = b->ts_base = dinamite_time_ticks();
+	self->prev_ptr = 0;
+	if (b->window != NULL)
+		((dinamite_block_header *)b->window)->ts_base = b->ts_base;
 }
 
-void logAccessI16(void *ptr, uint16_t value, int type, int file, int line,
-		  int col, int typeId, int varId) {
-    logentry le;
-    le.entry_type = LOG_ACCESS;
-    value_store vs;
-    vs.i16 = value;
-    fillAccessLog(&(le.entry.access), ptr, I16, vs, type, file, line, col,
-		  typeId, varId);
-    insertOrWrite(&le);
+/*
+ * Runs on the first event of every thread: assign the thread its id and
+ * set up its buffers. Threads that are excluded from the trace, or that
+ * could not get a buffer, keep a NULL cursor and are never traced.
+ */
+static void
+__dinamite_init_thread(dinamite_tls *self) {
+
+	dinamite_thread *t;
+	int32_t tid;
+	int ret = pthread_once(&dinamite_once_control, __dinamite_create_key);
+
+	if(ret) {
+		fprintf(stderr,
+			"pthread_once: could not create "
+			"a local-storage key: %s\n", strerror(ret));
+		exit(-1);
+	}
+
+	self->initialized = true;
+	self->coarse = ts_policy == TS_COARSE;
+	tid = __dinamite_get_next_id();
+	if(__dinamite_exclude_tid(tid))
+		return;
 
+	t = (dinamite_thread *)calloc(1, sizeof(dinamite_thread));
+	if (t == NULL) {
+		fprintf(stderr, "Warning: could not allocate state for "
+			"thread %d: %s\n", tid, strerror(errno));
+		return;
+	}
+	t->id = tid;
+	t->os_tid = (pid_t)syscall(SYS_gettid);
+	if(!__dinamite_init_buffer(t)) {
+		free(t);
+		return;
+	}
+
+	pthread_mutex_lock(&registry_mtx);
+	t->next = thread_list;
+	__atomic_store_n(&thread_list, t, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&registry_mtx);
+
+	self->thread = t;
+	__dinamite_use_buffer(self, t->cur);
+	pthread_setspecific(tls_key, t);
+
+	__dinamite_commit(__dinamite_put_thread_event(self->pos,
+						      REC_THREAD_START));
 }
 
-void logAccessI32(void *ptr, uint32_t value, int type, int file, int line,
-		  int col, int typeId, int varId) {
-    logentry le;
-    le.entry_type = LOG_ACCESS;
-    value_store vs;
-    vs.i32 = value;
-    fillAccessLog(&(le.entry.access), ptr, I32, vs, type, file, line, col,
-		  typeId, varId);
-    insertOrWrite(&le);
+/*
+ * Hand the full buffer over to the writer and continue with an empty
+ * one. If the writer has not returned any buffer yet it is falling
+ * behind, and we have no choice but to wait for it.
+ */
+static void
+__dinamite_swap_buffer(dinamite_tls *self) {
+
+	dinamite_thread *t = self->thread;
+	dinamite_buffer *b;
+	uint64_t start;
+
+	__dinamite_ring_push(&t->full, self->cur);
+	sem_post(&writer_sem);
+
+	if ((b = __dinamite_ring_pop(&t->empty)) == NULL) {
+		start = dinamite_time_nanoseconds();
+		while ((b = __dinamite_ring_pop(&t->empty)) == NULL)
+			sched_yield();
+		t->stalls++;
+		t->stall_ns += dinamite_time_nanoseconds() - start;
+	}
+	__atomic_store_n(&t->cur, b, __ATOMIC_RELEASE);
+	__dinamite_use_buffer(self, b);
+}
 
+/*
+ * Slow path of __dinamite_reserve(): set up the calling thread on its
+ * first event and swap buffers when the current one is full.
+ */
+__attribute__((noinline)) uint8_t *
+__dinamite_reserve_slow(void) {
+
+	dinamite_tls *self = &__dinamite_self;
+
+	if (!self->initialized)
+		__dinamite_init_thread(self);
+	if (self->cur == NULL)
+		return NULL;
+	if (self->pos >= self->end)
+		__dinamite_swap_buffer(self);
+	return self->pos;
 }
 
-void logAccessI64(void *ptr, uint64_t value, int type, int file, int line,
-		  int col, int typeId, int varId) {
-    logentry le;
-    le.entry_type = LOG_ACCESS;
-    value_store vs;
-    vs.i64 = value;
-    fillAccessLog(&(le.entry.access), ptr, I64, vs, type, file, line, col,
-		  typeId, varId);
-    insertOrWrite(&le);
+/*
+ * Slow path of logSampleCheck(), at the end of a sampling phase: start
+ * the next one. Threads start with a burst.
+ */
+__attribute__((noinline)) int
+__dinamite_sample_switch(void) {
+
+	dinamite_tls *self = &__dinamite_self;
+	int ret = pthread_once(&dinamite_once_control, __dinamite_create_key);
 
+	if(ret) {
+		fprintf(stderr,
+			"pthread_once: could not create "
+			"a local-storage key: %s\n", strerror(ret));
+		exit(-1);
+	}
+
+	if (sample_period == 0) {
+		self->sampled = true;
+		self->sample_left = LONG_MAX;
+	} else if (self->sampled && sample_burst < sample_period) {
+		self->sampled = false;
+		self->sample_left = sample_period - sample_burst;
+	} else {
+		self->sampled = true;
+		self->sample_left = sample_burst;
+	}
+	return self->sampled;
 }
 
-/* =============================
-   These don't exist: */
+/*
+ * TLS key destructor, run when a traced thread exits: record the end of
+ * the thread and hand its last buffer to the writer, which then closes
+ * the thread's file and recycles its buffers. Events the thread emits
+ * after this point, e.g. from other TLS destructors, are dropped.
+ */
+static void
+__dinamite_thread_exit(void *arg) {
+
+	dinamite_tls *self = &__dinamite_self;
+	dinamite_thread *t = (dinamite_thread *)arg;
+	uint8_t *p;
+
+	if ((p = __dinamite_reserve()) != NULL)
+		__dinamite_commit(__dinamite_put_thread_event(p,
+							      REC_THREAD_END));
 
-void logAccessF8(void *ptr, uint8_t value, int type, int file, int line,
-		 int col, int typeId, int varId) {
+	__dinamite_ring_push(&t->full, self->cur);
+	__atomic_store_n(&t->cur, NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&t->exited, true, __ATOMIC_RELEASE);
+	sem_post(&writer_sem);
+
+	self->cur = NULL;
+	self->thread = NULL;
+	self->pos = self->end = NULL;
 }
 
-void logAccessF16(void *ptr, uint16_t value, int type, int file, int line,
-		  int col, int typeId, int varId) {
+/* Open a per-thread log file. */
+
+void logInit(int64_t functionId) {
+
+	int ret = pthread_once(&dinamite_once_control, __dinamite_create_key);
 
+	if(ret) {
+		fprintf(stderr,
+			"pthread_once: could not create "
+			"a local-storage key: %s\n", strerror(ret));
+		exit(-1);
+	}
+}
+
+/*
+ * Ask the writer to drain all buffers, including the ones still being
+ * filled, and to seal the mapped windows if close_windows is set, and
+ * wait for it.
+ */
+static void
+__dinamite_flush(bool close_windows) {
+
+	unsigned long flush;
+
+	pthread_mutex_lock(&flush_mtx);
+	if (close_windows)
+		close_requested = true;
+	flush = ++flush_requested;
+	sem_post(&writer_sem);
+	while (flush_completed < flush)
+		pthread_cond_wait(&flush_cond, &flush_mtx);
+	pthread_mutex_unlock(&flush_mtx);
 }
 
-/* ============================= */
+/* Registered with atexit() in mmap mode */
+static void
+__dinamite_exit(void) {
 
-void logAccessF32(void *ptr, float value, int type, int file, int line, int col,
-		  int typeId, int varId) {
-    logentry le;
-    le.entry_type = LOG_ACCESS;
-    value_store vs;
-    vs.f32 = value;
-    fillAccessLog(&(le.entry.access), ptr, F32, vs, type, file, line, col,
-		  typeId, varId);
-    insertOrWrite(&le);
+	/* A forked child has no writer thread to wait for */
+	if (getpid() != dinamite_pid)
+		return;
+	__dinamite_flush(true);
 }
 
-void logAccessF64(void *ptr, double value, int type, int file, int line,
-		  int col, int typeId, int varId) {
-    logentry le;
-    le.entry_type = LOG_ACCESS;
-    value_store vs;
-    vs.f64 = value;
-    fillAccessLog(&(le.entry.access), ptr, F64, vs, type, file, line, col,
-		  typeId, varId);
-    insertOrWrite(&le);
+/*
+ * Make everything recorded so far durable. Mapped windows stay open, as
+ * their threads may go on filling them; they are sealed at exit.
+ */
+void logExit(int64_t functionId) {
+
+	dinamite_thread *t;
+	uint64_t stalls, stall_ns;
+
+	int ret = pthread_once(&dinamite_once_control, __dinamite_create_key);
+
+	if(ret) {
+		fprintf(stderr,
+			"pthread_once: could not create "
+			"a local-storage key: %s\n", strerror(ret));
+		exit(-1);
+	}
+
+	__dinamite_flush(false);
+
+	pthread_mutex_lock(&registry_mtx);
+	stalls = exited_stalls;
+	stall_ns = exited_stall_ns;
+	for (t = thread_list; t != NULL; t = t->next) {
+		if (t->stalls == 0)
+			continue;
+#ifdef DINAMITE_VERBOSE
+		fprintf(stderr, "Thread %d stalled %" PRIu64 " times "
+			"waiting for the trace writer (%" PRIu64 " ns)\n",
+			t->id, t->stalls, t->stall_ns);
+#endif
+		stalls += t->stalls;
+		stall_ns += t->stall_ns;
+	}
+	pthread_mutex_unlock(&registry_mtx);
+	if (block_codec == BLOCK_LZ && lz_raw_bytes > 0)
+		fprintf(stderr, "Compressed %" PRIu64 " bytes of trace to "
+			"%" PRIu64 " (%.2fx) at %.1f MB/s\n", lz_raw_bytes,
+			lz_bytes, (double)lz_raw_bytes / lz_bytes,
+			lz_ns > 0 ? lz_raw_bytes * 1e3 / lz_ns : 0.0);
+	if (stalls > 0)
+		fprintf(stderr, "Warning: application threads stalled "
+			"%" PRIu64 " times (%" PRIu64 " ns) waiting for the "
+			"trace writer. Consider raising DINAMITE_NBUFFERS.\n",
+			stalls, stall_ns);
 }
+
+
 #endif
@@ -1,16 +1,24 @@
 #ifndef BINARY_INSTRUMENTATION_H
 #define BINARY_INSTRUMENTATION_H
 
-#define TID_TYPE char
+#include <stdint.h>
+
+#define TID_TYPE int32_t
 
 enum fn_events {
     FN_BEGIN, FN_END
 };
 
+/*
+ * The structures below are the decoded, in-memory form of trace
+ * records. On disk the records use the compact encoding described
+ * further down.
+ */
+
 typedef struct _fnlog {
 	TID_TYPE thread_id;
 	char fn_event_type;
-	int function_id;
+	int64_t function_id;
 	uint64_t fn_timestamp;
 } fnlog;
 
@@ -34,13 +42,13 @@ typedef struct _accesslog {
 	void *ptr; // 8
 	char value_type; // 1
 	value_store value; // 8
-	TID_TYPE thread_id; // 1
+	TID_TYPE thread_id; // 4
 	char type; // 1
-	uint16_t file; // 2 // Is this enough bits for the file ID?
+	int64_t file; // 8
 	uint16_t line; // 2
 	uint16_t col; // 2
-	uint16_t typeId; // 2
-	uint16_t varId; // 2
+	int64_t typeId; // 8
+	int64_t varId; // 8
 	uint64_t ac_timestamp; // 8
 } accesslog;
 
@@ -48,16 +56,46 @@ typedef struct _alloclog {
 	void *addr; // 8
 	uint64_t size; // 8
 	uint64_t num; // 8
-	uint16_t type; // 2
-	uint16_t file; // 2
+	int64_t type; // 8
+	int64_t file; // 8
 	uint16_t line; // 2
 	uint16_t col; // 2
-	TID_TYPE thread_id; // 1
+	TID_TYPE thread_id; // 4
 	uint64_t al_timestamp; // 8
 } alloclog;
 
+/*
+ * A loop's affine accesses of one site, summarized by the compiler
+ * pass: `count' accesses of `size' bytes each, starting at `base' and
+ * `stride' bytes apart. Logged once, when the loop exits.
+ */
+typedef struct _rangelog {
+	void *base;
+	int64_t stride;
+	uint64_t count;
+	uint32_t size;
+	TID_TYPE thread_id;
+	char type;
+	int64_t file;
+	uint16_t line;
+	uint16_t col;
+	int64_t typeId;
+	int64_t varId;
+	uint64_t rg_timestamp;
+} rangelog;
+
+enum thread_events {
+    THREAD_START, THREAD_END
+};
+
+typedef struct _threadlog {
+	TID_TYPE thread_id;
+	char thread_event_type;
+	uint64_t th_timestamp;
+} threadlog;
+
 enum entry_types {
-	LOG_FN, LOG_ALLOC, LOG_ACCESS
+	LOG_FN, LOG_ALLOC, LOG_ACCESS, LOG_THREAD, LOG_RANGE
 };
 
 typedef struct _logentry {
@@ -66,7 +104,193 @@ typedef struct _logentry {
 		fnlog fn;
 		accesslog access;
 		alloclog alloc;
+		threadlog thread;
+		rangelog range;
 	} entry;
 } logentry;
 
+/*
+ * On-disk format
+ * ==============
+ *
+ * Every trace.bin.<tid> file starts with a dinamite_file_header, which
+ * maps the 32-bit DINAMITE thread id to the OS thread id and names the
+ * clock the timestamps come from, and is followed by blocks, starting
+ * at offset header_size. A block is a dinamite_block_header, `size'
+ * bytes of records and `padding' unused bytes. A block header with a
+ * zero magic marks the end of the trace.
+ *
+ * Timestamps are in the ticks of that clock. Each block header carries
+ * the calibration that converts the ticks of its records to nanoseconds
+ * (see dinamite_ticks_to_ns() in dinamite_time.h), and the timestamp
+ * the first record of the block is a delta against.
+ *
+ * With the TS_COARSE timestamp policy only function and thread events
+ * are timestamped. Allocation and access records carry no timestamp;
+ * readers number the records of each thread instead, so their order is
+ * still known.
+ *
+ * A block whose codec is not BLOCK_RAW holds `size' bytes of compressed
+ * data that expand to `raw_size' bytes of records. Every block is
+ * compressed on its own, so blocks can be decompressed independently.
+ *
+ * Blocks flagged BLOCK_OPEN were still being filled when the trace was
+ * last written to (DINAMITE_OUTPUT=mmap, a process that did not exit
+ * cleanly): their `size' is the room in the block. The thread filling
+ * the block publishes the records it has committed in `fill' after each
+ * record, with DINAMITE_FILL(). Readers decode those and ignore the
+ * rest of the block, which can hold a record the thread had started.
+ *
+ * Each record starts with a tag byte:
+ *
+ *	bits 0-2	record kind (REC_*)
+ *	bits 3-5	value_type, access records only
+ *	bits 6-7	access type (ACC_*), access and range records only
+ *
+ * followed by the fields of that kind, in the order below. Unsigned
+ * fields are LEB128 varints, signed ones are zigzag varints. Addresses
+ * and timestamps are deltas against the previous record of the block
+ * (against zero and ts_base for the first one), which is why blocks can
+ * be decoded on their own, unless the block is flagged BLOCK_CONTINUED:
+ * then it carries on from the previous one.
+ *
+ *	REC_FN_BEGIN/END	function_id, timestamp delta
+ *	REC_ALLOC		addr delta, size, num, type, file, line, col,
+ *				timestamp delta (not with TS_COARSE)
+ *	REC_ACCESS		ptr delta, value, file, line, col, typeId,
+ *				varId, timestamp delta (not with TS_COARSE)
+ *	REC_THREAD_START/END	timestamp delta
+ *	REC_RANGE		base delta, stride, count, size, file, line,
+ *				col, typeId, varId, timestamp delta (not
+ *				with TS_COARSE)
+ *
+ * Access values are stored as a single byte for I8, varints for the
+ * other integer types and pointers, and raw little-endian bytes for
+ * floating point values. Range records carry no values.
+ *
+ * The function, file, type and variable IDs (function_id, file, an
+ * allocation's type, typeId, varId) are 64-bit: with DIN_HASH_IDS the
+ * compiler pass uses hashes of the names as IDs (see dinamite_idstore.h).
+ */
+
+#define DINAMITE_TRACE_MAGIC 0x544e4944 /* "DINT" */
+#define DINAMITE_TRACE_VERSION 11
+
+#define DINAMITE_BLOCK_MAGIC 0x4b4c4244 /* "DBLK" */
+
+/* Upper bound on the encoded size of any record */
+#define DINAMITE_MAX_RECORD 128
+
+typedef struct _dinamite_file_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	int32_t thread_id;
+	int32_t os_tid;
+	uint32_t clock_source; /* enum dinamite_clock_sources */
+	uint32_t ts_policy;    /* enum timestamp_policies */
+} dinamite_file_header;
+
+enum timestamp_policies {
+	TS_DELTA, TS_COARSE
+};
+
+enum block_flags {
+	BLOCK_CONTINUED = 1,
+	BLOCK_OPEN = 2
+};
+
+typedef struct _dinamite_block_header {
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t size;
+	uint32_t padding;
+	uint32_t nrecords;
+	uint32_t codec;        /* enum block_codecs */
+	uint32_t raw_size;     /* size of the records before compression */
+	uint32_t reserved;
+	uint64_t tick_base;    /* dinamite_clock_calibration */
+	uint64_t ns_base;
+	uint64_t mult;
+	uint64_t ts_base;      /* in ticks */
+	uint64_t fill;         /* BLOCK_OPEN: DINAMITE_FILL() committed */
+} dinamite_block_header;
+
+/*
+ * The records and bytes a thread has filled in, published together in
+ * one word so that nobody sees a count that does not match the bytes.
+ * Blocks are far smaller than 4GB.
+ */
+#define DINAMITE_FILL(nrecords, used) \
+	(((uint64_t)(nrecords) << 32) | (uint64_t)(used))
+#define DINAMITE_FILL_USED(fill) ((size_t)((fill) & 0xffffffffu))
+#define DINAMITE_FILL_RECORDS(fill) ((uint32_t)((fill) >> 32))
+
+enum block_codecs {
+	BLOCK_RAW, BLOCK_LZ   /* dinamite_lz.h */
+};
+
+enum record_kinds {
+	REC_INVALID, REC_FN_BEGIN, REC_FN_END, REC_ALLOC, REC_ACCESS,
+	REC_THREAD_START, REC_THREAD_END, REC_RANGE
+};
+
+enum access_types {
+	ACC_READ, ACC_WRITE, ACC_ARG
+};
+
+#define REC_TAG(kind, vtype, acc) \
+	((uint8_t)((kind) | ((vtype) << 3) | ((acc) << 6)))
+#define REC_KIND(tag)		((tag) & 0x7)
+#define REC_VALUE_TYPE(tag)	(((tag) >> 3) & 0x7)
+#define REC_ACCESS_TYPE(tag)	(((tag) >> 6) & 0x3)
+
+static inline uint8_t *
+dinamite_put_varint(uint8_t *p, uint64_t v) {
+
+	while (v >= 0x80) {
+		*p++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+static inline uint8_t *
+dinamite_put_svarint(uint8_t *p, int64_t v) {
+
+	return dinamite_put_varint(p, ((uint64_t)v << 1) ^
+				   (uint64_t)(v >> 63));
+}
+
+/* Returns NULL if the varint runs past `end'. */
+static inline const uint8_t *
+dinamite_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+
+	uint64_t result = 0;
+	int shift = 0;
+
+	while (p < end && shift < 64) {
+		uint8_t byte = *p++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*v = result;
+			return p;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+static inline const uint8_t *
+dinamite_get_svarint(const uint8_t *p, const uint8_t *end, int64_t *v) {
+
+	uint64_t u;
+
+	if ((p = dinamite_get_varint(p, end, &u)) == NULL)
+		return NULL;
+	*v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+	return p;
+}
+
 #endif
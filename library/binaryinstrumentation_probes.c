@@ -0,0 +1,250 @@
+/*
+ * The probes called by instrumented code. This file is linked into the
+ * binary runtime library, and compiled on its own to
+ * instrumentation_inline.bc, from which the compiler pass inlines the
+ * probes into instrumented code.
+ */
+
+#include <string.h>
+
+#include "binaryinstrumentation_probes.h"
+
+static inline void
+__dinamite_log_fn(char fn_event_type, int64_t functionId) {
+
+	uint8_t *p = __dinamite_reserve();
+
+	if (p == NULL)
+		return;
+	*p++ = REC_TAG(fn_event_type == FN_BEGIN ? REC_FN_BEGIN : REC_FN_END,
+		       0, 0);
+	p = dinamite_put_svarint(p, functionId);
+	p = __dinamite_put_timestamp(p);
+	__dinamite_commit(p);
+}
+
+static inline int
+__dinamite_access_type(int type) {
+
+	switch (type) {
+	case 'w':
+		return ACC_WRITE;
+	case 'a':
+		return ACC_ARG;
+	default:
+		return ACC_READ;
+	}
+}
+
+static inline void
+__dinamite_log_access(void *ptr, char value_type, value_store value,
+		      int type, int64_t file, int line, int col, int64_t typeId,
+		      int64_t varId) {
+
+	uint8_t *p = __dinamite_reserve();
+
+	if (p == NULL)
+		return;
+	*p++ = REC_TAG(REC_ACCESS, value_type, __dinamite_access_type(type));
+	p = __dinamite_put_address(p, ptr);
+	switch (value_type) {
+	case I8:
+		*p++ = value.i8;
+		break;
+	case I16:
+		p = dinamite_put_varint(p, value.i16);
+		break;
+	case I32:
+		p = dinamite_put_varint(p, value.i32);
+		break;
+	case I64:
+		p = dinamite_put_varint(p, value.i64);
+		break;
+	case F32:
+		memcpy(p, &value.f32, sizeof(float));
+		p += sizeof(float);
+		break;
+	case F64:
+		memcpy(p, &value.f64, sizeof(double));
+		p += sizeof(double);
+		break;
+	default:
+		p = dinamite_put_varint(p, (uintptr_t)value.ptr);
+		break;
+	}
+	p = dinamite_put_svarint(p, file);
+	p = dinamite_put_svarint(p, line);
+	p = dinamite_put_svarint(p, col);
+	p = dinamite_put_svarint(p, typeId);
+	p = dinamite_put_svarint(p, varId);
+	p = __dinamite_put_data_timestamp(p);
+	__dinamite_commit(p);
+}
+
+void logFnBegin(int64_t functionId) {
+    __dinamite_log_fn(FN_BEGIN, functionId);
+}
+
+void logFnEnd(int64_t functionId) {
+    __dinamite_log_fn(FN_END, functionId);
+}
+
+void logAlloc(void *addr, uint64_t size, uint64_t num, int64_t type,
+	      int64_t file, int line, int col) {
+    uint8_t *p = __dinamite_reserve();
+
+    if (p == NULL)
+	    return;
+    *p++ = REC_TAG(REC_ALLOC, 0, 0);
+    p = __dinamite_put_address(p, addr);
+    p = dinamite_put_varint(p, size);
+    p = dinamite_put_varint(p, num);
+    p = dinamite_put_svarint(p, type);
+    p = dinamite_put_svarint(p, file);
+    p = dinamite_put_svarint(p, line);
+    p = dinamite_put_svarint(p, col);
+    p = __dinamite_put_data_timestamp(p);
+    __dinamite_commit(p);
+}
+
+void logAccessPtr(void *ptr, void *value, int type, int64_t file, int line,
+		  int col, int64_t typeId, int64_t varId) {
+
+    value_store vs;
+    vs.ptr = value;
+    __dinamite_log_access(ptr, PTR, vs, type, file, line, col,
+			  typeId, varId);
+
+}
+
+/* This function logs an access when we are sure that what we are acccessing is
+ * a null-terminated string. A typical use-case is when we print a string passed
+ * as an argument to the tracepoint function. Using this function when we are
+ * not sure whether the address points to a null-terminated string is unsafe,
+ * because we may crash when we try to print it later.
+ *
+ * Another crucial assumption we are making is that the strings being accessed
+ * are static. Here is the reason: To avoid the runtime overhead associated
+ * with string printing, this function simply stores the pointer when called,
+ * and at the very end of the program goes over the pointers and prints them.
+ * Here we are assuming that the pointers accessed earlier in the program are
+ * still valid at the end of the program and that they are still pointing to the
+ * same values as they did when they were actually accessed. This will be true
+ * for static strings, but may not be true for dynamic strings. So this function
+ * is not safe to use with dynamically allocated strings.
+ */
+void logAccessStaticString(void *ptr, void *value, int type, int64_t file,
+			   int line, int col, int64_t typeId, int64_t varId) {
+
+    value_store vs;
+    vs.ptr = value;
+    __dinamite_log_access(ptr, PTR, vs, type, file, line, col,
+			  typeId, varId);
+}
+
+void logAccessI8(void *ptr, uint8_t value, int type, int64_t file, int line,
+		 int col, int64_t typeId, int64_t varId) {
+    value_store vs;
+    vs.i8 = value;
+    __dinamite_log_access(ptr, I8, vs, type, file, line, col,
+			  typeId, varId);
+
+}
+
+void logAccessI16(void *ptr, uint16_t value, int type, int64_t file, int line,
+		  int col, int64_t typeId, int64_t varId) {
+    value_store vs;
+    vs.i16 = value;
+    __dinamite_log_access(ptr, I16, vs, type, file, line, col,
+			  typeId, varId);
+
+}
+
+void logAccessI32(void *ptr, uint32_t value, int type, int64_t file, int line,
+		  int col, int64_t typeId, int64_t varId) {
+    value_store vs;
+    vs.i32 = value;
+    __dinamite_log_access(ptr, I32, vs, type, file, line, col,
+			  typeId, varId);
+
+}
+
+void logAccessI64(void *ptr, uint64_t value, int type, int64_t file, int line,
+		  int col, int64_t typeId, int64_t varId) {
+    value_store vs;
+    vs.i64 = value;
+    __dinamite_log_access(ptr, I64, vs, type, file, line, col,
+			  typeId, varId);
+
+}
+
+/*
+ * Logged by the compiler pass at the exit of a loop, in place of the
+ * per-iteration events of an access whose address is an affine function
+ * of the loop's induction variable.
+ */
+void logAccessRange(void *base, int64_t stride, uint64_t count, int size,
+		    int type, int64_t file, int line, int col, int64_t typeId,
+		    int64_t varId) {
+    uint8_t *p;
+
+    if (count == 0)
+	    return;
+    if ((p = __dinamite_reserve()) == NULL)
+	    return;
+    *p++ = REC_TAG(REC_RANGE, 0, __dinamite_access_type(type));
+    p = __dinamite_put_address(p, base);
+    p = dinamite_put_svarint(p, stride);
+    p = dinamite_put_varint(p, count);
+    p = dinamite_put_varint(p, size);
+    p = dinamite_put_svarint(p, file);
+    p = dinamite_put_svarint(p, line);
+    p = dinamite_put_svarint(p, col);
+    p = dinamite_put_svarint(p, typeId);
+    p = dinamite_put_svarint(p, varId);
+    p = __dinamite_put_data_timestamp(p);
+    __dinamite_commit(p);
+}
+
+/*
+ * Called on entry to every function the pass compiled with DIN_SAMPLING=1,
+ * to pick whether its instrumented or its clean copy runs. Counts down
+ * the current sampling phase; switching phases is left to the library.
+ */
+int logSampleCheck(void) {
+    dinamite_tls *self = &__dinamite_self;
+
+    if (likely(--self->sample_left > 0))
+	    return self->sampled;
+    return __dinamite_sample_switch();
+}
+
+/* =============================
+   These don't exist: */
+
+void logAccessF8(void *ptr, uint8_t value, int type, int64_t file, int line,
+		 int col, int64_t typeId, int64_t varId) {
+}
+
+void logAccessF16(void *ptr, uint16_t value, int type, int64_t file, int line,
+		  int col, int64_t typeId, int64_t varId) {
+
+}
+
+/* ============================= */
+
+void logAccessF32(void *ptr, float value, int type, int64_t file, int line,
+		  int col, int64_t typeId, int64_t varId) {
+    value_store vs;
+    vs.f32 = value;
+    __dinamite_log_access(ptr, F32, vs, type, file, line, col,
+			  typeId, varId);
+}
+
+void logAccessF64(void *ptr, double value, int type, int64_t file, int line,
+		  int col, int64_t typeId, int64_t varId) {
+    value_store vs;
+    vs.f64 = value;
+    __dinamite_log_access(ptr, F64, vs, type, file, line, col,
+			  typeId, varId);
+}
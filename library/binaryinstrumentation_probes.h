@@ -0,0 +1,132 @@
+#ifndef BINARY_INSTRUMENTATION_PROBES_H
+#define BINARY_INSTRUMENTATION_PROBES_H
+
+/*
+ * The fast path of the binary runtime's probes: the per-thread TLS block
+ * and the code that encodes a record into the current buffer. It is
+ * shared by the runtime library and binaryinstrumentation_probes.c,
+ * which is also compiled to instrumentation_inline.bc so the compiler
+ * pass can inline the probes into instrumented code (DIN_INLINE_PROBES).
+ * Only __dinamite_self, __dinamite_reserve_slow() and
+ * __dinamite_sample_switch() cross over to the runtime library.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "binaryinstrumentation.h"
+#include "dinamite_time.h"
+
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+
+typedef struct _dinamite_buffer {
+	uint8_t *data;
+	size_t size;         /* room for records at data */
+	uint8_t *window;     /* holds the block header, mmap and direct modes */
+	off_t offset;        /* file offset of the block, mmap and direct modes */
+	uint64_t *fill;      /* DINAMITE_FILL() of the owning thread: at
+				own_fill, or in the block header of a mapped
+				window, where readers find it after a crash */
+	uint64_t own_fill;
+	size_t written;      /* bytes already written out by the writer */
+	uint32_t nwritten;   /* records already written out by the writer */
+	uint64_t ts_base;    /* timestamp the first record is a delta against */
+	struct _dinamite_thread *owner;
+} dinamite_buffer;
+
+/*
+ * Everything the probes need about the calling thread lives in one
+ * initial-exec TLS block, so the fast path of a probe is a TLS load and
+ * a bounds check. The delta-coding state restarts with every buffer.
+ */
+typedef struct _dinamite_tls {
+	uint8_t *pos;             /* where the next record goes */
+	uint8_t *end;             /* records may start below this */
+	dinamite_buffer *cur;
+	struct _dinamite_thread *thread;  /* state shared with the writer */
+	uint64_t prev_ts;
+	uintptr_t prev_ptr;
+	bool coarse;              /* TS_COARSE timestamp policy */
+	bool initialized;
+	bool sampled;             /* in a sampling burst */
+	long sample_left;         /* sampling checks left in this phase */
+} dinamite_tls;
+
+extern __thread dinamite_tls __dinamite_self
+	__attribute__((tls_model("initial-exec")));
+
+uint8_t *__dinamite_reserve_slow(void);
+int __dinamite_sample_switch(void);
+
+/*
+ * Return where the calling thread should encode its next record, or
+ * NULL if the thread is not traced. The record is published with
+ * __dinamite_commit(). A thread that has not been set up yet has a
+ * NULL cursor and limit, so it takes the slow path like a thread whose
+ * buffer is full.
+ */
+static inline uint8_t *
+__dinamite_reserve(void) {
+
+	dinamite_tls *self = &__dinamite_self;
+
+	if (unlikely(self->pos >= self->end))
+		return __dinamite_reserve_slow();
+	return self->pos;
+}
+
+static inline void
+__dinamite_commit(uint8_t *end) {
+
+	dinamite_tls *self = &__dinamite_self;
+	dinamite_buffer *b = self->cur;
+	uint64_t fill = __atomic_load_n(b->fill, __ATOMIC_RELAXED);
+
+	self->pos = end;
+	__atomic_store_n(b->fill,
+			 DINAMITE_FILL(DINAMITE_FILL_RECORDS(fill) + 1,
+				       end - b->data), __ATOMIC_RELEASE);
+}
+
+static inline uint8_t *
+__dinamite_put_timestamp(uint8_t *p) {
+
+	dinamite_tls *self = &__dinamite_self;
+	uint64_t ts = dinamite_time_ticks();
+
+	p = dinamite_put_varint(p, ts - self->prev_ts);
+	self->prev_ts = ts;
+	return p;
+}
+
+/* Timestamp of an allocation or access, unless the policy elides it */
+static inline uint8_t *
+__dinamite_put_data_timestamp(uint8_t *p) {
+
+	if (__dinamite_self.coarse)
+		return p;
+	return __dinamite_put_timestamp(p);
+}
+
+static inline uint8_t *
+__dinamite_put_address(uint8_t *p, void *addr) {
+
+	dinamite_tls *self = &__dinamite_self;
+
+	p = dinamite_put_svarint(p, (int64_t)((uintptr_t)addr -
+					       self->prev_ptr));
+	self->prev_ptr = (uintptr_t)addr;
+	return p;
+}
+
+static inline uint8_t *
+__dinamite_put_thread_event(uint8_t *p, int kind) {
+
+	*p++ = REC_TAG(kind, 0, 0);
+	return __dinamite_put_timestamp(p);
+}
+
+#endif
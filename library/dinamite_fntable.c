@@ -0,0 +1,550 @@
+/*
+ * The per-function switches of dinamite_fntable.h, and the control
+ * file, signal and socket that flip them.
+ */
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dinamite_fntable.h"
+
+/* Read by every instrumented function on entry, see dinamite_fntable.h */
+uint8_t __dinamite_fn_disabled[DINAMITE_FN_TABLE_SIZE];
+
+/* A socket client that stops sending for this long is dropped */
+#define CLIENT_TIMEOUT_SEC 5
+
+typedef struct _fn_entry {
+	char *name;
+	int64_t id;
+} fn_entry;
+
+/* map_functions.json, read on the first command */
+static fn_entry *functions;
+static size_t nfunctions, functions_size;
+static int map_state; /* 0: not read yet, 1: read, -1: not available */
+static pthread_mutex_t fn_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *control_file;
+static int control_pipe[2] = { -1, -1 };
+static int control_socket = -1;
+
+static const char *
+skip_space(const char *p) {
+
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		p++;
+	return p;
+}
+
+static char *
+put_utf8(char *o, unsigned int c) {
+
+	if (c < 0x80) {
+		*o++ = c;
+	} else if (c < 0x800) {
+		*o++ = 0xc0 | (c >> 6);
+		*o++ = 0x80 | (c & 0x3f);
+	} else {
+		*o++ = 0xe0 | (c >> 12);
+		*o++ = 0x80 | ((c >> 6) & 0x3f);
+		*o++ = 0x80 | (c & 0x3f);
+	}
+	return o;
+}
+
+/*
+ * The JSON string at *p, unescaped into a new buffer. Moves *p past
+ * it. Returns NULL if it is not a well-formed string.
+ */
+static char *
+parse_string(const char **p) {
+
+	const char *s = *p, *end;
+	unsigned int c;
+	char *out, *o;
+
+	if (*s++ != '"')
+		return NULL;
+	for (end = s; *end != '"'; end++) {
+		if (*end == '\0' || (*end == '\\' && *++end == '\0'))
+			return NULL;
+	}
+	/* No escape takes fewer bytes than the UTF-8 it stands for */
+	if ((out = malloc(end - s + 1)) == NULL)
+		return NULL;
+
+	for (o = out; s < end; s++) {
+		if (*s != '\\') {
+			*o++ = *s;
+			continue;
+		}
+		switch (*++s) {
+		case 'b': *o++ = '\b'; break;
+		case 'f': *o++ = '\f'; break;
+		case 'n': *o++ = '\n'; break;
+		case 'r': *o++ = '\r'; break;
+		case 't': *o++ = '\t'; break;
+		case 'u':
+			if (end - s < 5 || sscanf(s + 1, "%4x", &c) != 1) {
+				free(out);
+				return NULL;
+			}
+			o = put_utf8(o, c);
+			s += 4;
+			break;
+		default: /* '"', '\\' and '/' */
+			*o++ = *s;
+			break;
+		}
+	}
+	*o = '\0';
+	*p = end + 1;
+	return out;
+}
+
+static int
+compare_slots(const void *a, const void *b) {
+
+	uint64_t x = DINAMITE_FN_SLOT(((const fn_entry *)a)->id);
+	uint64_t y = DINAMITE_FN_SLOT(((const fn_entry *)b)->id);
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Sort the map by slot, so that functions sharing a switch are next to
+ * each other, and warn if there are any.
+ */
+static void
+sort_slots(const char *path) {
+
+	size_t i, shared = 0;
+
+	qsort(functions, nfunctions, sizeof(fn_entry), compare_slots);
+	for (i = 1; i < nfunctions; i++) {
+		if (compare_slots(&functions[i], &functions[i - 1]) == 0)
+			shared++;
+	}
+
+	if (shared > 0)
+		fprintf(stderr, "Warning: %zu functions of %s share a switch "
+			"with another one, commands must match all of them or "
+			"none\n", shared, path);
+}
+
+static int
+add_function(char *name, int64_t id) {
+
+	fn_entry *grown;
+
+	if (nfunctions == functions_size) {
+		functions_size = functions_size ? functions_size * 2 : 1024;
+		grown = realloc(functions, functions_size * sizeof(fn_entry));
+		if (grown == NULL)
+			return 0;
+		functions = grown;
+	}
+	functions[nfunctions].name = name;
+	functions[nfunctions].id = id;
+	nfunctions++;
+	return 1;
+}
+
+/* Read map_functions.json, an object from function name to ID */
+static int
+load_map(void) {
+
+	const char *env, *path, *p;
+	char buf[4096], *json, *name, *end;
+	int64_t id;
+	long len;
+	FILE *f;
+
+	if ((path = getenv("DINAMITE_FN_MAP")) == NULL || *path == '\0') {
+		env = getenv("DIN_MAPS");
+		snprintf(buf, sizeof(buf), "%s/map_functions.json",
+			 env != NULL && *env != '\0' ? env : ".");
+		path = buf;
+	}
+
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "%s: %s, functions cannot be switched\n",
+			path, strerror(errno));
+		return 0;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET) != 0 || (json = malloc(len + 1)) == NULL ||
+	    fread(json, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "%s: could not read it, functions cannot be "
+			"switched\n", path);
+		fclose(f);
+		return 0;
+	}
+	json[len] = '\0';
+	fclose(f);
+
+	p = skip_space(json);
+	if (*p++ != '{')
+		goto bad;
+	p = skip_space(p);
+	while (*p != '}') {
+		if ((name = parse_string(&p)) == NULL)
+			goto bad;
+		p = skip_space(p);
+		if (*p++ != ':') {
+			free(name);
+			goto bad;
+		}
+		id = strtoll(p, &end, 10);
+		if (end == p || !add_function(name, id)) {
+			free(name);
+			goto bad;
+		}
+		p = skip_space(end);
+		if (*p == ',')
+			p = skip_space(p + 1);
+		else if (*p != '}')
+			goto bad;
+	}
+	free(json);
+
+	sort_slots(path);
+	return 1;
+
+bad:
+	fprintf(stderr, "%s: not a function map at byte %ld, functions "
+		"cannot be switched\n", path, (long)(p - json));
+	free(json);
+	while (nfunctions > 0)
+		free(functions[--nfunctions].name);
+	return 0;
+}
+
+/*
+ * Whether pattern matches all of the functions in [first, last), which
+ * share a switch. Returns -1 if it matches only some of them.
+ */
+static int
+match_slot(const char *pattern, size_t first, size_t last) {
+
+	size_t i, matched = 0;
+
+	for (i = first; i < last; i++) {
+		if (fnmatch(pattern, functions[i].name, 0) == 0)
+			matched++;
+	}
+	if (matched == 0 || matched == last - first)
+		return matched != 0;
+
+	for (i = first; fnmatch(pattern, functions[i].name, 0) != 0; i++)
+		;
+	fprintf(stderr, "%s: %s shares its switch with a function the "
+		"pattern does not match\n", pattern, functions[i].name);
+	return -1;
+}
+
+int
+dinamite_fn_set(const char *pattern, int enable) {
+
+	size_t i, last;
+	int n = 0, pass, ret;
+
+	pthread_mutex_lock(&fn_mtx);
+	if (map_state == 0)
+		map_state = load_map() ? 1 : -1;
+	if (map_state < 0) {
+		pthread_mutex_unlock(&fn_mtx);
+		return -1;
+	}
+	/* Check every slot before flipping any, so a refused command has
+	 * no effect */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < nfunctions; i = last) {
+			for (last = i + 1; last < nfunctions &&
+			     compare_slots(&functions[last], &functions[i]) == 0;
+			     last++)
+				;
+			if ((ret = match_slot(pattern, i, last)) < 0) {
+				pthread_mutex_unlock(&fn_mtx);
+				return -2;
+			}
+			if (ret == 0 || pass == 0)
+				continue;
+			__atomic_store_n(&__dinamite_fn_disabled[
+				DINAMITE_FN_SLOT(functions[i].id)], !enable,
+				__ATOMIC_RELAXED);
+			n += last - i;
+		}
+	}
+	pthread_mutex_unlock(&fn_mtx);
+	return n;
+}
+
+int
+dinamite_fn_command(const char *line, const char **error) {
+
+	char *copy, *verb, *pattern, *end;
+	int enable, ret;
+
+	line = skip_space(line);
+	if (*line == '\0' || *line == '#')
+		return 0;
+	if ((copy = strdup(line)) == NULL) {
+		*error = "out of memory";
+		return -1;
+	}
+
+	verb = copy;
+	for (pattern = verb; *pattern != '\0' &&
+		     strchr(" \t\r\n", *pattern) == NULL; pattern++)
+		;
+	if (*pattern != '\0')
+		*pattern++ = '\0';
+	pattern = (char *)skip_space(pattern);
+	for (end = pattern + strlen(pattern); end > pattern &&
+		     strchr(" \t\r\n", end[-1]) != NULL; end--)
+		;
+	*end = '\0';
+
+	if (strcmp(verb, "enable") == 0) {
+		enable = 1;
+	} else if (strcmp(verb, "disable") == 0) {
+		enable = 0;
+	} else {
+		*error = "unknown command, expected enable or disable";
+		free(copy);
+		return -1;
+	}
+	if (*pattern == '\0') {
+		*error = "missing function pattern";
+		free(copy);
+		return -1;
+	}
+
+	ret = dinamite_fn_set(pattern, enable);
+	if (ret == -2)
+		*error = "pattern matches only some of the functions sharing "
+			"a switch";
+	else if (ret < 0)
+		*error = "function map not available";
+	if (ret < 0)
+		ret = -1;
+	free(copy);
+	return ret;
+}
+
+static void
+apply_control_file(void) {
+
+	const char *error;
+	char *line = NULL;
+	size_t cap = 0;
+	unsigned int lineno = 0;
+	FILE *f;
+
+	if ((f = fopen(control_file, "r")) == NULL) {
+		fprintf(stderr, "DINAMITE_FN_CONTROL %s: %s\n", control_file,
+			strerror(errno));
+		return;
+	}
+	while (getline(&line, &cap, f) > 0) {
+		lineno++;
+		if (dinamite_fn_command(line, &error) < 0)
+			fprintf(stderr, "%s:%u: %s\n", control_file, lineno,
+				error);
+	}
+	free(line);
+	fclose(f);
+}
+
+static void
+serve_client(int fd) {
+
+	struct timeval timeout = { CLIENT_TIMEOUT_SEC, 0 };
+	const char *error;
+	char *line = NULL;
+	size_t cap = 0;
+	FILE *in, *out;
+	int n, outfd;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if ((outfd = dup(fd)) < 0 || (in = fdopen(fd, "r")) == NULL) {
+		if (outfd >= 0)
+			close(outfd);
+		close(fd);
+		return;
+	}
+	if ((out = fdopen(outfd, "w")) == NULL) {
+		close(outfd);
+		fclose(in);
+		return;
+	}
+
+	while (getline(&line, &cap, in) > 0) {
+		if ((n = dinamite_fn_command(line, &error)) < 0)
+			fprintf(out, "error %s\n", error);
+		else
+			fprintf(out, "ok %d\n", n);
+		if (fflush(out) != 0)
+			break;
+	}
+	free(line);
+	fclose(out);
+	fclose(in);
+}
+
+/* Only hands the work to the control thread: write() is signal-safe */
+static void
+control_signal(int sig) {
+
+	int saved = errno;
+	char c = 0;
+	ssize_t ret;
+
+	/* A full pipe already has a reload pending */
+	ret = write(control_pipe[1], &c, 1);
+	(void)ret;
+	errno = saved;
+}
+
+static void *
+control_thread(void *arg) {
+
+	struct pollfd fds[2];
+	nfds_t nfds = 0;
+	sigset_t all;
+	char drain[64];
+	int fd;
+
+	/* Leave the application's signals to its own threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+	if (control_pipe[0] >= 0) {
+		fds[nfds].fd = control_pipe[0];
+		fds[nfds++].events = POLLIN;
+	}
+	if (control_socket >= 0) {
+		fds[nfds].fd = control_socket;
+		fds[nfds++].events = POLLIN;
+	}
+
+	for (;;) {
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll: function switches no longer "
+				"controllable: %s\n", strerror(errno));
+			return NULL;
+		}
+		if (control_pipe[0] >= 0 && (fds[0].revents & POLLIN)) {
+			if (read(control_pipe[0], drain, sizeof(drain)) > 0)
+				apply_control_file();
+		}
+		if (control_socket >= 0 && (fds[nfds - 1].revents & POLLIN)) {
+			if ((fd = accept(control_socket, NULL, NULL)) >= 0)
+				serve_client(fd);
+		}
+	}
+	return NULL;
+}
+
+static int
+open_control_socket(const char *path) {
+
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "DINAMITE_FN_SOCKET %s: path too long\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* Left behind by an earlier run */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, 4) != 0) {
+		fprintf(stderr, "DINAMITE_FN_SOCKET %s: %s\n", path,
+			strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+__attribute__((constructor)) static void
+dinamite_fn_init(void) {
+
+	struct sigaction sa;
+	pthread_t thread;
+	const char *env;
+	int sig = 0, ret;
+
+	control_file = getenv("DINAMITE_FN_CONTROL");
+	if (control_file != NULL && *control_file == '\0')
+		control_file = NULL;
+	if (control_file != NULL)
+		apply_control_file();
+
+	env = getenv("DINAMITE_FN_SIGNAL");
+	if (env != NULL && *env != '\0') {
+		sig = atoi(env);
+		if (control_file == NULL) {
+			fprintf(stderr, "Warning: DINAMITE_FN_SIGNAL needs "
+				"DINAMITE_FN_CONTROL, ignoring it\n");
+			sig = 0;
+		} else if (sig <= 0 || sig >= NSIG) {
+			fprintf(stderr, "Warning: bad DINAMITE_FN_SIGNAL %s, "
+				"ignoring it\n", env);
+			sig = 0;
+		}
+	}
+
+	env = getenv("DINAMITE_FN_SOCKET");
+	if (env != NULL && *env != '\0')
+		control_socket = open_control_socket(env);
+
+	if (sig != 0) {
+		if (pipe(control_pipe) != 0) {
+			fprintf(stderr, "pipe: DINAMITE_FN_SIGNAL not "
+				"installed: %s\n", strerror(errno));
+			sig = 0;
+		} else {
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = control_signal;
+			sigemptyset(&sa.sa_mask);
+			sa.sa_flags = SA_RESTART;
+			sigaction(sig, &sa, NULL);
+		}
+	}
+	if (sig == 0 && control_socket < 0)
+		return;
+
+	ret = pthread_create(&thread, NULL, control_thread, NULL);
+	if (ret) {
+		fprintf(stderr, "pthread_create: function switches not "
+			"controllable: %s\n", strerror(ret));
+		return;
+	}
+	pthread_detach(thread);
+}
@@ -0,0 +1,57 @@
+#ifndef DINAMITE_FNTABLE_H
+#define DINAMITE_FNTABLE_H
+
+/*
+ * Per-function switches. With DIN_FN_TOGGLES=1 every instrumented
+ * function starts by loading its byte of __dinamite_fn_disabled, at
+ * DINAMITE_FN_SLOT() of its function ID, and runs its uninstrumented
+ * copy while the byte is set. The table lives in .bss: all functions
+ * start enabled and untouched pages cost nothing.
+ *
+ * The runtime flips the bytes on commands, one per line:
+ *
+ *	enable GLOB
+ *	disable GLOB
+ *
+ * where GLOB is matched with fnmatch(3) against the function names of
+ * map_functions.json. Empty lines and lines starting with '#' are
+ * ignored. Commands come from:
+ *
+ *	DINAMITE_FN_CONTROL	a file, applied at startup
+ *	DINAMITE_FN_SIGNAL	a signal number; the control file is
+ *				applied again whenever it arrives
+ *	DINAMITE_FN_SOCKET	a Unix stream socket to create; each
+ *				command gets a reply line, "ok N" with the
+ *				number of functions it matched, or
+ *				"error ..."
+ *
+ * map_functions.json is read from DINAMITE_FN_MAP, or else from
+ * $DIN_MAPS or the current directory. With DIN_HASH_IDS the slot is
+ * the ID's low bits, so functions can share a byte. The slot is built
+ * into their code, so the runtime cannot separate them: it warns when
+ * the map is loaded and refuses, without flipping anything, a command
+ * that matches some of the functions of a shared byte but not all.
+ */
+
+#include <stdint.h>
+
+#define DINAMITE_FN_TABLE "__dinamite_fn_disabled"
+#define DINAMITE_FN_TABLE_BITS 22
+#define DINAMITE_FN_TABLE_SIZE (1 << DINAMITE_FN_TABLE_BITS)
+#define DINAMITE_FN_SLOT(id) \
+	((uint64_t)(id) & (DINAMITE_FN_TABLE_SIZE - 1))
+
+/*
+ * Set or clear the switch of every function matching pattern. Returns
+ * the number of functions matched, -1 if the map is not available, or
+ * -2 if pattern matches only some of the functions sharing a switch.
+ */
+int dinamite_fn_set(const char *pattern, int enable);
+
+/*
+ * Run one command line. Returns what dinamite_fn_set() does, 0 for a
+ * comment or an empty line, or -1 with *error set.
+ */
+int dinamite_fn_command(const char *line, const char **error);
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef DINAMITE_IDSTORE_H
+#define DINAMITE_IDSTORE_H
+
+/*
+ * The ID store: $DIN_MAPS/maps.bin, shared by the compiler pass's source,
+ * type, variable and function maps and by its function size table.
+ *
+ * The file is an append-only log of records. Compiler processes append
+ * a record for every name they need an ID for and is not in the log
+ * yet, with a single O_APPEND write, so records never interleave and no
+ * locking is needed. IDs are not stored: replaying the log, the n-th
+ * distinct name of a kind gets ID n, and later records of a name that
+ * is already known are ignored. Every process that replays the log
+ * therefore arrives at the same IDs, however the appends raced. For
+ * IDSTORE_FUNCTION_SIZES the first record of a name holds its size.
+ *
+ * With DIN_HASH_IDS set, the pass instead uses idstore_hash() of the
+ * name as its ID and needs nothing from the log to assign it, so
+ * compiler processes need no coordination and separate builds of the
+ * same code agree on their IDs. It still appends the names it used,
+ * flagged IDSTORE_HASHED with the hash as the value, so that the maps
+ * can be exported and two names with the same hash are caught when the
+ * pass saves its maps. A store should hold IDs of one mode only.
+ *
+ * A record is an idstore_record followed by the name, zero padded to a
+ * multiple of 8 bytes. A record that fails its checksum (left behind
+ * by a compiler that died mid-write) is skipped by looking for the next
+ * valid record one byte further on.
+ *
+ * dinamite-maps turns the store into the map_*.json files that the
+ * analysis tools read.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define IDSTORE_FILE "maps.bin"
+#define IDSTORE_MAGIC 0x44495344 /* "DSID" */
+
+/* idstore_record flags */
+#define IDSTORE_HASHED 0x1 /* value is the name's idstore_hash() */
+
+enum idstore_kinds {
+	IDSTORE_SOURCES, IDSTORE_TYPES, IDSTORE_VARIABLES, IDSTORE_FUNCTIONS,
+	IDSTORE_FUNCTION_SIZES, IDSTORE_KINDS
+};
+
+typedef struct _idstore_record {
+	uint32_t magic;
+	uint32_t length;     /* of the whole record, padding included */
+	uint32_t kind;       /* enum idstore_kinds */
+	uint32_t name_len;
+	int64_t value;       /* size, for IDSTORE_FUNCTION_SIZES */
+	uint32_t checksum;   /* idstore_checksum() */
+	uint32_t flags;
+} idstore_record;
+
+#define IDSTORE_RECORD_LENGTH(name_len) \
+	((sizeof(idstore_record) + (name_len) + 7) & ~(size_t)7)
+
+/* FNV-1a over the kind, name, value and flags */
+static inline uint32_t
+idstore_checksum(const idstore_record *r, const char *name) {
+
+	uint32_t h = 2166136261u;
+	const uint8_t *p;
+	size_t i;
+
+	p = (const uint8_t *)&r->kind;
+	for (i = 0; i < sizeof(r->kind) + sizeof(r->name_len); i++)
+		h = (h ^ p[i]) * 16777619u;
+	p = (const uint8_t *)&r->value;
+	for (i = 0; i < sizeof(r->value); i++)
+		h = (h ^ p[i]) * 16777619u;
+	p = (const uint8_t *)&r->flags;
+	for (i = 0; i < sizeof(r->flags); i++)
+		h = (h ^ p[i]) * 16777619u;
+	p = (const uint8_t *)name;
+	for (i = 0; i < r->name_len; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+/*
+ * The ID of a name in hashed mode: 64-bit FNV-1a, kept non-negative so
+ * that it can never be taken for the -1 of a missing ID.
+ */
+static inline int64_t
+idstore_hash(const char *name, size_t len) {
+
+	uint64_t h = 14695981039346656037ull;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (uint8_t)name[i]) * 1099511628211ull;
+	return (int64_t)(h & INT64_MAX);
+}
+
+/*
+ * Check the record at p. Returns its length, 0 if it may still be
+ * being appended (it runs past end), or -1 if p does not hold a record.
+ */
+static inline long
+idstore_check(const uint8_t *p, const uint8_t *end) {
+
+	idstore_record r;
+
+	if ((size_t)(end - p) < sizeof(idstore_record))
+		return 0;
+	memcpy(&r, p, sizeof(r));
+	if (r.magic != IDSTORE_MAGIC || r.kind >= IDSTORE_KINDS ||
+	    r.length != IDSTORE_RECORD_LENGTH(r.name_len))
+		return -1;
+	if ((size_t)(end - p) < r.length)
+		return 0;
+	if (r.checksum != idstore_checksum(&r, (const char *)p + sizeof(r)))
+		return -1;
+	return r.length;
+}
+
+#endif
@@ -0,0 +1,209 @@
+#include <string.h>
+
+#include "dinamite_lz.h"
+
+#define LZ_HASH_LOG 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/* The last LZ_LAST_LITERALS bytes are always literals ... */
+#define LZ_LAST_LITERALS 5
+/* ... and no match starts in the last LZ_MATCH_LIMIT bytes. */
+#define LZ_MATCH_LIMIT 12
+
+static inline uint32_t
+lz_read32(const uint8_t *p) {
+
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Number of equal bytes at p and ref, not going past limit */
+static inline size_t
+lz_common_length(const uint8_t *p, const uint8_t *ref, const uint8_t *limit) {
+
+	const uint8_t *start = p;
+	uint64_t a, b;
+
+	while (limit - p >= 8) {
+		memcpy(&a, p, sizeof(a));
+		memcpy(&b, ref, sizeof(b));
+		if (a != b) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return p - start + (__builtin_ctzll(a ^ b) >> 3);
+#else
+			return p - start + (__builtin_clzll(a ^ b) >> 3);
+#endif
+		}
+		p += 8;
+		ref += 8;
+	}
+	while (p < limit && *p == *ref) {
+		p++;
+		ref++;
+	}
+	return p - start;
+}
+
+static inline uint32_t
+lz_hash(uint32_t v) {
+
+	return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+static inline uint8_t *
+lz_put_length(uint8_t *op, size_t len) {
+
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/* Room a sequence needs in the output, counting the length bytes */
+static inline size_t
+lz_sequence_size(size_t lit, size_t mlen) {
+
+	return 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1;
+}
+
+size_t
+dinamite_lz_compress(const uint8_t *src, size_t n, uint8_t *dst,
+		     size_t cap) {
+
+	uint32_t table[1 << LZ_HASH_LOG];
+	const uint8_t *ip = src, *anchor = src, *end = src + n;
+	const uint8_t *ref, *m, *r;
+	uint8_t *op = dst, *oend = dst + cap, *token;
+	size_t lit, mlen, off;
+	uint32_t seq, h;
+
+	memset(table, 0, sizeof(table));
+
+	if (n > LZ_MATCH_LIMIT) {
+		const uint8_t *mflimit = end - LZ_MATCH_LIMIT;
+		const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+
+		ip++;
+		while (ip < mflimit) {
+			seq = lz_read32(ip);
+			h = lz_hash(seq);
+			ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+			if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+			    lz_read32(ref) != seq) {
+				/* Skip faster through incompressible data */
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			m = ip + LZ_MIN_MATCH;
+			r = ref + LZ_MIN_MATCH;
+			m += lz_common_length(m, r, matchlimit);
+
+			lit = ip - anchor;
+			mlen = m - ip - LZ_MIN_MATCH;
+			if ((size_t)(oend - op) < lz_sequence_size(lit, mlen))
+				return 0;
+
+			token = op++;
+			*token = (lit >= 15 ? 15 : lit) << 4;
+			if (lit >= 15)
+				op = lz_put_length(op, lit - 15);
+			memcpy(op, anchor, lit);
+			op += lit;
+			off = ip - ref;
+			*op++ = (uint8_t)off;
+			*op++ = (uint8_t)(off >> 8);
+			*token |= mlen >= 15 ? 15 : mlen;
+			if (mlen >= 15)
+				op = lz_put_length(op, mlen - 15);
+
+			ip = anchor = m;
+			table[lz_hash(lz_read32(ip - 2))] =
+				(uint32_t)(ip - 2 - src);
+		}
+	}
+
+	lit = end - anchor;
+	if ((size_t)(oend - op) < 1 + lit + lit / 255 + 1)
+		return 0;
+	token = op++;
+	*token = (lit >= 15 ? 15 : lit) << 4;
+	if (lit >= 15)
+		op = lz_put_length(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+	return op - dst;
+}
+
+static inline const uint8_t *
+lz_get_length(const uint8_t *ip, const uint8_t *iend, size_t *len) {
+
+	uint8_t b;
+
+	do {
+		if (ip >= iend)
+			return NULL;
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+	return ip;
+}
+
+long
+dinamite_lz_decompress(const uint8_t *src, size_t n, uint8_t *dst,
+		       size_t cap) {
+
+	const uint8_t *ip = src, *iend = src + n;
+	uint8_t *op = dst, *oend = dst + cap, *ref;
+	size_t lit, mlen, off;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		lit = token >> 4;
+		if (lit == 15 && (ip = lz_get_length(ip, iend, &lit)) == NULL)
+			return -1;
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - dst))
+			return -1;
+
+		mlen = token & 15;
+		if (mlen == 15 && (ip = lz_get_length(ip, iend, &mlen)) == NULL)
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+
+		ref = op - off;
+		if (off >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			while (mlen-- > 0)
+				*op++ = *ref++;
+		}
+	}
+	return op - dst;
+}
@@ -0,0 +1,26 @@
+#ifndef _DINAMITE_LZ_H
+#define _DINAMITE_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A small LZ77 block codec for trace blocks, using the LZ4 block layout:
+ * a sequence of (token, literals, 16-bit offset, match length) where the
+ * token holds the literal and match lengths in its two nibbles, and
+ * lengths of 15 or more continue in extra bytes. The last sequence has
+ * literals only. Every block is compressed on its own.
+ */
+
+/* Largest compressed size of n bytes */
+#define DINAMITE_LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+/* Returns the compressed size, or 0 if it does not fit in cap bytes. */
+size_t dinamite_lz_compress(const uint8_t *src, size_t n, uint8_t *dst,
+			    size_t cap);
+
+/* Returns the decompressed size, or -1 if src is corrupt or too large. */
+long dinamite_lz_decompress(const uint8_t *src, size_t n, uint8_t *dst,
+			    size_t cap);
+
+#endif
@@ -0,0 +1,623 @@
+/*
+ * Export the compiler pass's ID store (see dinamite_idstore.h) to the
+ * JSON maps the analysis tools read: map_sources.json, map_types.json,
+ * map_variables.json, map_functions.json and function_sizes.json, each
+ * an object from name to ID (or size).
+ *
+ * Usage: dinamite-maps [maps directory]
+ *
+ * The directory defaults to $DIN_MAPS, or the current directory. The
+ * files are written next to maps.bin, each replaced atomically.
+ *
+ * Names recorded with DIN_HASH_IDS keep their hash as the ID. Two names
+ * of a kind with the same hash are reported, and make the export fail.
+ *
+ * If the pass ran with DIN_STATS=1, the per-module records it appended
+ * to instrumentation_stats.log are merged into instrumentation_stats.json
+ * as well: the last record of each module, and the sum of their totals.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dinamite_idstore.h"
+
+static const char *map_files[IDSTORE_KINDS] = {
+	"map_sources.json", "map_types.json", "map_variables.json",
+	"map_functions.json", "function_sizes.json"
+};
+
+/* As in InstrumentationStats.hpp */
+#define STATS_LOG "instrumentation_stats.log"
+#define STATS_FILE "instrumentation_stats.json"
+
+/* Modules of the stats log are indexed under a kind of their own */
+#define STATS_MODULES IDSTORE_KINDS
+
+typedef struct _map_entry {
+	const char *name;
+	uint32_t name_len;
+	uint32_t kind;
+	int64_t value;       /* for STATS_MODULES, its last stats_record */
+} map_entry;
+
+/* A line of the stats log; the fields are kept as JSON text */
+typedef struct _stats_record {
+	const char *totals;
+	size_t totals_len;
+	const char *functions;
+	size_t functions_len;
+} stats_record;
+
+/* A merged total; key is the JSON string of its name */
+typedef struct _stats_total {
+	const char *key;
+	size_t key_len;
+	double sum;
+} stats_total;
+
+/* Open-addressing index of the entries, by kind and name */
+static map_entry *entries;
+static size_t nentries, entries_size;
+static int64_t *slots;      /* entry index + 1, 0 if free */
+static size_t nslots;
+static int64_t next_id[IDSTORE_KINDS];
+static bool seen_hashed, seen_sequential;
+
+static stats_record *stats;
+static size_t nstats, stats_size;
+static stats_total *totals;
+static size_t ntotals, totals_size;
+
+static uint64_t
+hash_name(uint32_t kind, const char *name, uint32_t len) {
+
+	uint64_t h = 14695981039346656037ull ^ kind;
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (uint8_t)name[i]) * 1099511628211ull;
+	return h;
+}
+
+static int64_t *
+find_slot(uint32_t kind, const char *name, uint32_t len) {
+
+	size_t i = hash_name(kind, name, len) & (nslots - 1);
+	map_entry *e;
+
+	while (slots[i] != 0) {
+		e = &entries[slots[i] - 1];
+		if (e->kind == kind && e->name_len == len &&
+		    memcmp(e->name, name, len) == 0)
+			break;
+		i = (i + 1) & (nslots - 1);
+	}
+	return &slots[i];
+}
+
+static void
+grow_index(void) {
+
+	int64_t *old = slots;
+	size_t i, old_nslots = nslots;
+	map_entry *e;
+
+	nslots = nslots ? nslots * 2 : 1024;
+	if ((slots = calloc(nslots, sizeof(int64_t))) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < old_nslots; i++) {
+		if (old[i] == 0)
+			continue;
+		e = &entries[old[i] - 1];
+		*find_slot(e->kind, e->name, e->name_len) = old[i];
+	}
+	free(old);
+}
+
+/* The slot of name, or the free slot to put it in */
+static int64_t *
+lookup(uint32_t kind, const char *name, uint32_t len) {
+
+	if (2 * (nentries + 1) > nslots)
+		grow_index();
+	return find_slot(kind, name, len);
+}
+
+/* Add a name that lookup() did not find, in the slot it returned */
+static map_entry *
+add_entry(int64_t *slot, uint32_t kind, const char *name, uint32_t len) {
+
+	map_entry *e;
+
+	if (nentries == entries_size) {
+		entries_size = entries_size ? entries_size * 2 : 1024;
+		entries = realloc(entries, entries_size * sizeof(map_entry));
+		if (entries == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	e = &entries[nentries++];
+	e->name = name;
+	e->name_len = len;
+	e->kind = kind;
+	*slot = nentries;
+	return e;
+}
+
+/* Same rules as IdStore::replay() in the pass */
+static void
+replay(const idstore_record *r, const char *name) {
+
+	int64_t *slot;
+	map_entry *e;
+
+	if (r->kind != IDSTORE_FUNCTION_SIZES) {
+		if (r->flags & IDSTORE_HASHED)
+			seen_hashed = true;
+		else
+			seen_sequential = true;
+	}
+
+	slot = lookup(r->kind, name, r->name_len);
+	if (*slot != 0)
+		return;
+
+	e = add_entry(slot, r->kind, name, r->name_len);
+	if (r->kind == IDSTORE_FUNCTION_SIZES || (r->flags & IDSTORE_HASHED))
+		e->value = r->value;
+	else
+		e->value = next_id[r->kind]++;
+}
+
+static int
+compare_ids(const void *a, const void *b) {
+
+	const map_entry *x = *(const map_entry * const *)a;
+	const map_entry *y = *(const map_entry * const *)b;
+
+	if (x->kind != y->kind)
+		return x->kind < y->kind ? -1 : 1;
+	if (x->value != y->value)
+		return x->value < y->value ? -1 : 1;
+	return 0;
+}
+
+/* Report the names that ended up with the same ID */
+static bool
+check_collisions(void) {
+
+	map_entry **sorted;
+	bool ok = true;
+	size_t i;
+
+	if ((sorted = malloc(nentries * sizeof(map_entry *) + 1)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < nentries; i++)
+		sorted[i] = &entries[i];
+	qsort(sorted, nentries, sizeof(map_entry *), compare_ids);
+
+	for (i = 1; i < nentries; i++) {
+		if (sorted[i]->kind == IDSTORE_FUNCTION_SIZES ||
+		    compare_ids(&sorted[i - 1], &sorted[i]) != 0)
+			continue;
+		fprintf(stderr, "%s: ID %" PRId64 " collision: \"%.*s\" and "
+			"\"%.*s\"\n", map_files[sorted[i]->kind],
+			sorted[i]->value, (int)sorted[i - 1]->name_len,
+			sorted[i - 1]->name, (int)sorted[i]->name_len,
+			sorted[i]->name);
+		ok = false;
+	}
+	free(sorted);
+	return ok;
+}
+
+static void
+put_json_string(FILE *f, const char *s, uint32_t len) {
+
+	uint32_t i;
+	unsigned char c;
+
+	fputc('"', f);
+	for (i = 0; i < len; i++) {
+		c = s[i];
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * The name to write path under before renaming it into place. Fails
+ * rather than cut the name short, which could clobber another file.
+ */
+static bool
+temp_name(char *tmp, size_t size, const char *path) {
+
+	int len = snprintf(tmp, size, "%s.%d", path, (int)getpid());
+
+	if (len < 0 || (size_t)len >= size) {
+		fprintf(stderr, "%s: path too long\n", path);
+		return false;
+	}
+	return true;
+}
+
+static bool
+write_map(const char *dir, uint32_t kind) {
+
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	bool first = true;
+	size_t i;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, map_files[kind]);
+	if (!temp_name(tmp, sizeof(tmp), path))
+		return false;
+	if ((f = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		return false;
+	}
+	fputc('{', f);
+	for (i = 0; i < nentries; i++) {
+		if (entries[i].kind != kind)
+			continue;
+		if (!first)
+			fputs(", ", f);
+		first = false;
+		put_json_string(f, entries[i].name, entries[i].name_len);
+		fprintf(f, ": %" PRId64, entries[i].value);
+	}
+	fputs("}\n", f);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+/* The end of the JSON string at p, or NULL */
+static const char *
+skip_string(const char *p, const char *end) {
+
+	if (p >= end || *p != '"')
+		return NULL;
+	for (p++; p < end; p++) {
+		if (*p == '\\')
+			p++;
+		else if (*p == '"')
+			return p + 1;
+	}
+	return NULL;
+}
+
+/* The end of the JSON object at p, or NULL */
+static const char *
+skip_object(const char *p, const char *end) {
+
+	int depth = 0;
+
+	if (p >= end || *p != '{')
+		return NULL;
+	while (p < end) {
+		if (*p == '"') {
+			if ((p = skip_string(p, end)) == NULL)
+				return NULL;
+			continue;
+		}
+		if (*p == '{' || *p == '[')
+			depth++;
+		else if ((*p == '}' || *p == ']') && --depth == 0)
+			return p + 1;
+		p++;
+	}
+	return NULL;
+}
+
+static bool
+expect(const char **p, const char *end, const char *text) {
+
+	size_t len = strlen(text);
+
+	if ((size_t)(end - *p) < len || memcmp(*p, text, len) != 0)
+		return false;
+	*p += len;
+	return true;
+}
+
+static void
+add_total(const char *key, size_t key_len, double n) {
+
+	size_t i;
+
+	for (i = 0; i < ntotals; i++) {
+		if (totals[i].key_len == key_len &&
+		    memcmp(totals[i].key, key, key_len) == 0) {
+			totals[i].sum += n;
+			return;
+		}
+	}
+	if (ntotals == totals_size) {
+		totals_size = totals_size ? totals_size * 2 : 32;
+		totals = realloc(totals, totals_size * sizeof(stats_total));
+		if (totals == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	totals[ntotals].key = key;
+	totals[ntotals].key_len = key_len;
+	totals[ntotals++].sum = n;
+}
+
+/*
+ * Go through a totals object, {"name": number, ...}, adding its numbers
+ * to the merged totals if add is set. Returns its end, or NULL. The
+ * text must be followed by a zero byte somewhere, for strtod().
+ */
+static const char *
+scan_totals(const char *p, const char *end, bool add) {
+
+	const char *key;
+	char *num_end;
+	double n;
+
+	if (!expect(&p, end, "{"))
+		return NULL;
+	if (expect(&p, end, "}"))
+		return p;
+	for (;;) {
+		key = p;
+		if ((p = skip_string(p, end)) == NULL ||
+		    !expect(&p, end, ": "))
+			return NULL;
+		n = strtod(p, &num_end);
+		if (num_end == p || num_end > end)
+			return NULL;
+		if (add)
+			add_total(key, p - 2 - key, n);
+		p = num_end;
+		if (expect(&p, end, "}"))
+			return p;
+		if (!expect(&p, end, ", "))
+			return NULL;
+	}
+}
+
+#define STATS_RECORD_START "{\"module\": "
+
+/*
+ * Index the stats record that makes up the whole of [p, end), in the
+ * layout InstrumentationStats::save() writes:
+ *
+ *	{"module": <string>, "totals": {...}, "functions": {...}}
+ *
+ * A later record of the same module replaces the earlier one.
+ */
+static bool
+add_stats(const char *p, const char *end) {
+
+	const char *module;
+	uint32_t module_len;
+	stats_record r;
+	int64_t *slot;
+	map_entry *e;
+
+	if (!expect(&p, end, STATS_RECORD_START))
+		return false;
+	module = p;
+	if ((p = skip_string(p, end)) == NULL || p - module > UINT32_MAX)
+		return false;
+	module_len = p - module;
+
+	r.totals = p + strlen(", \"totals\": ");
+	if (!expect(&p, end, ", \"totals\": ") ||
+	    (p = scan_totals(p, end, false)) == NULL)
+		return false;
+	r.totals_len = p - r.totals;
+
+	r.functions = p + strlen(", \"functions\": ");
+	if (!expect(&p, end, ", \"functions\": ") ||
+	    (p = skip_object(p, end)) == NULL)
+		return false;
+	r.functions_len = p - r.functions;
+	if (!expect(&p, end, "}") || p != end)
+		return false;
+
+	if (nstats == stats_size) {
+		stats_size = stats_size ? stats_size * 2 : 1024;
+		stats = realloc(stats, stats_size * sizeof(stats_record));
+		if (stats == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	stats[nstats] = r;
+
+	slot = lookup(STATS_MODULES, module, module_len);
+	if (*slot == 0)
+		e = add_entry(slot, STATS_MODULES, module, module_len);
+	else
+		e = &entries[*slot - 1];
+	e->value = nstats++;
+	return true;
+}
+
+static int
+compare_totals(const void *a, const void *b) {
+
+	const stats_total *x = a, *y = b;
+	size_t len = x->key_len < y->key_len ? x->key_len : y->key_len;
+	int c = memcmp(x->key, y->key, len);
+
+	if (c != 0)
+		return c;
+	return x->key_len < y->key_len ? -1 : x->key_len > y->key_len;
+}
+
+/*
+ * Merge the stats log into STATS_FILE. A line that is not a whole
+ * record (a compiler died mid-write, and the next record was appended
+ * right after its part) is searched for a record that starts later.
+ */
+static bool
+merge_stats(const char *dir) {
+
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	const char *p, *end, *line_end, *start;
+	size_t damaged = 0, i;
+	bool first = true;
+	stats_record *r;
+	char *log;
+	long size;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, STATS_LOG);
+	if ((f = fopen(path, "r")) == NULL) {
+		if (errno == ENOENT)
+			return true;
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET) != 0 ||
+	    (log = malloc(size + 1)) == NULL ||
+	    fread(log, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "%s: could not read it\n", path);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	log[size] = '\0';
+
+	for (p = log, end = log + size; p < end; p = line_end + 1) {
+		if ((line_end = memchr(p, '\n', end - p)) == NULL)
+			line_end = end;
+		if (p == line_end || add_stats(p, line_end))
+			continue;
+		damaged++;
+		for (start = p + 1; start < line_end; start++) {
+			if (add_stats(start, line_end))
+				break;
+		}
+	}
+	if (damaged > 0)
+		fprintf(stderr, "%s: skipped %zu damaged records\n", path,
+			damaged);
+
+	snprintf(path, sizeof(path), "%s/%s", dir, STATS_FILE);
+	if (!temp_name(tmp, sizeof(tmp), path))
+		return false;
+	if ((f = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		return false;
+	}
+	fputs("{\"modules\": {", f);
+	for (i = 0; i < nentries; i++) {
+		if (entries[i].kind != STATS_MODULES)
+			continue;
+		if (!first)
+			fputs(", ", f);
+		first = false;
+		r = &stats[entries[i].value];
+		fwrite(entries[i].name, 1, entries[i].name_len, f);
+		fputs(": {\"functions\": ", f);
+		fwrite(r->functions, 1, r->functions_len, f);
+		fputs(", \"totals\": ", f);
+		fwrite(r->totals, 1, r->totals_len, f);
+		fputc('}', f);
+		scan_totals(r->totals, r->totals + r->totals_len, true);
+	}
+	fputs("}, \"totals\": {", f);
+	qsort(totals, ntotals, sizeof(stats_total), compare_totals);
+	for (i = 0; i < ntotals; i++) {
+		fprintf(f, "%s%.*s: %.17g", i > 0 ? ", " : "",
+			(int)totals[i].key_len, totals[i].key, totals[i].sum);
+	}
+	fputs("}}\n", f);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+int
+main(int argc, char **argv) {
+
+	const char *dir = getenv("DIN_MAPS");
+	const uint8_t *base, *p, *end;
+	char path[4096];
+	struct stat st;
+	uint32_t kind;
+	int fd, ret = 0;
+	long len;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [maps directory]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 2)
+		dir = argv[1];
+	if (dir == NULL || *dir == '\0')
+		dir = ".";
+
+	snprintf(path, sizeof(path), "%s/%s", dir, IDSTORE_FILE);
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (st.st_size == 0)
+		base = NULL;
+	else if ((base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd,
+			      0)) == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	for (p = base, end = base + st.st_size; p < end; ) {
+		if ((len = idstore_check(p, end)) == 0)
+			break;
+		if (len < 0) {
+			p++;
+			continue;
+		}
+		replay((const idstore_record *)p,
+		       (const char *)p + sizeof(idstore_record));
+		p += len;
+	}
+
+	if (seen_hashed && seen_sequential)
+		fprintf(stderr, "%s mixes hashed and sequential IDs\n", path);
+	if (!check_collisions())
+		return 1;
+
+	for (kind = 0; kind < IDSTORE_KINDS; kind++) {
+		if (!write_map(dir, kind))
+			ret = 1;
+	}
+	if (!merge_stats(dir))
+		ret = 1;
+	return ret;
+}
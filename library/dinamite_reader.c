@@ -0,0 +1,489 @@
+/*
+ * Decode the binary traces written by binaryinstrumentation.c and print
+ * them as text, one record per line:
+ *
+ *	fb|fe <function_id> <thread_id> <timestamp>
+ *	tb|te <thread_id> <timestamp>
+ *	alloc <addr> <size> <num> <type> <file> <line> <col> <thread_id>
+ *		<timestamp>
+ *	<ptr> <value> <type> <file> <line> <col> <typeId> <varId> <thread_id>
+ *		<timestamp>
+ *	range <base> <stride> <count> <size> <type> <file> <line> <col>
+ *		<typeId> <varId> <thread_id> <timestamp>
+ *
+ * Usage: dinamite-reader [-r] [-v] trace.bin.<tid> [trace.bin.<tid> ...]
+ *
+ * Timestamps are printed in nanoseconds, or in the raw ticks of the
+ * clock the trace was recorded with if -r is given. Allocations,
+ * accesses and ranges of traces recorded with DINAMITE_TIMESTAMPS=coarse
+ * have no timestamp; they show the sequence number of the record in its
+ * thread instead. With -v the mapping
+ * of each DINAMITE thread id to its OS thread id, and the clock, are
+ * printed to stderr.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "binaryinstrumentation.h"
+#include "dinamite_lz.h"
+#include "dinamite_time.h"
+
+typedef struct _decode_state {
+	int32_t thread_id;
+	uint64_t prev_ts;
+	uintptr_t prev_ptr;
+	dinamite_clock_calibration clock;
+	bool coarse;       /* TS_COARSE trace */
+	uint64_t seq;      /* records decoded so far */
+} decode_state;
+
+static bool raw_ticks = false;
+
+#define GET_VARINT(p, end, v)					\
+	do {							\
+		if (((p) = dinamite_get_varint((p), (end), (v))) == NULL) \
+			return NULL;				\
+	} while (0)
+
+#define GET_SVARINT(p, end, v)					\
+	do {							\
+		if (((p) = dinamite_get_svarint((p), (end), (v))) == NULL) \
+			return NULL;				\
+	} while (0)
+
+static const uint8_t *
+decode_timestamp(decode_state *st, const uint8_t *p, const uint8_t *end,
+		 uint64_t *ts) {
+
+	uint64_t delta;
+
+	GET_VARINT(p, end, &delta);
+	st->prev_ts += delta;
+	*ts = raw_ticks ? st->prev_ts :
+		dinamite_ticks_to_ns(&st->clock, st->prev_ts);
+	return p;
+}
+
+/* Allocations and accesses are not timestamped in coarse traces. */
+static const uint8_t *
+decode_data_timestamp(decode_state *st, const uint8_t *p,
+		      const uint8_t *end, uint64_t *ts) {
+
+	if (st->coarse) {
+		*ts = st->seq;
+		return p;
+	}
+	return decode_timestamp(st, p, end, ts);
+}
+
+static const uint8_t *
+decode_address(decode_state *st, const uint8_t *p, const uint8_t *end,
+	       void **addr) {
+
+	int64_t delta;
+
+	GET_SVARINT(p, end, &delta);
+	st->prev_ptr += (uintptr_t)delta;
+	*addr = (void *)st->prev_ptr;
+	return p;
+}
+
+/*
+ * Decode one record starting at p into le. Returns a pointer past the
+ * record, or NULL if the record is malformed or truncated.
+ */
+static const uint8_t *
+decode_record(decode_state *st, const uint8_t *p, const uint8_t *end,
+	      logentry *le) {
+
+	static const char access_chars[] = { 'r', 'w', 'a', '?' };
+	uint8_t tag;
+	uint64_t u;
+	int64_t s;
+
+	if (p >= end)
+		return NULL;
+	tag = *p++;
+
+	switch (REC_KIND(tag)) {
+	case REC_FN_BEGIN:
+	case REC_FN_END:
+		le->entry_type = LOG_FN;
+		le->entry.fn.thread_id = st->thread_id;
+		le->entry.fn.fn_event_type =
+			REC_KIND(tag) == REC_FN_BEGIN ? FN_BEGIN : FN_END;
+		GET_SVARINT(p, end, &s);
+		le->entry.fn.function_id = s;
+		return decode_timestamp(st, p, end,
+					&le->entry.fn.fn_timestamp);
+
+	case REC_ALLOC:
+		le->entry_type = LOG_ALLOC;
+		le->entry.alloc.thread_id = st->thread_id;
+		if ((p = decode_address(st, p, end,
+					&le->entry.alloc.addr)) == NULL)
+			return NULL;
+		GET_VARINT(p, end, &le->entry.alloc.size);
+		GET_VARINT(p, end, &le->entry.alloc.num);
+		GET_SVARINT(p, end, &s);
+		le->entry.alloc.type = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.alloc.file = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.alloc.line = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.alloc.col = s;
+		return decode_data_timestamp(st, p, end,
+					     &le->entry.alloc.al_timestamp);
+
+	case REC_ACCESS:
+		le->entry_type = LOG_ACCESS;
+		le->entry.access.thread_id = st->thread_id;
+		le->entry.access.value_type = REC_VALUE_TYPE(tag);
+		le->entry.access.type = access_chars[REC_ACCESS_TYPE(tag)];
+		if ((p = decode_address(st, p, end,
+					&le->entry.access.ptr)) == NULL)
+			return NULL;
+		memset(&le->entry.access.value, 0, sizeof(value_store));
+		switch (le->entry.access.value_type) {
+		case I8:
+			if (p >= end)
+				return NULL;
+			le->entry.access.value.i8 = *p++;
+			break;
+		case I16:
+			GET_VARINT(p, end, &u);
+			le->entry.access.value.i16 = u;
+			break;
+		case I32:
+			GET_VARINT(p, end, &u);
+			le->entry.access.value.i32 = u;
+			break;
+		case I64:
+			GET_VARINT(p, end, &u);
+			le->entry.access.value.i64 = u;
+			break;
+		case F32:
+			if (end - p < (long)sizeof(float))
+				return NULL;
+			memcpy(&le->entry.access.value.f32, p, sizeof(float));
+			p += sizeof(float);
+			break;
+		case F64:
+			if (end - p < (long)sizeof(double))
+				return NULL;
+			memcpy(&le->entry.access.value.f64, p, sizeof(double));
+			p += sizeof(double);
+			break;
+		case PTR:
+			GET_VARINT(p, end, &u);
+			le->entry.access.value.ptr = (void *)(uintptr_t)u;
+			break;
+		default:
+			return NULL;
+		}
+		GET_SVARINT(p, end, &s);
+		le->entry.access.file = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.access.line = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.access.col = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.access.typeId = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.access.varId = s;
+		return decode_data_timestamp(st, p, end,
+					     &le->entry.access.ac_timestamp);
+
+	case REC_RANGE:
+		le->entry_type = LOG_RANGE;
+		le->entry.range.thread_id = st->thread_id;
+		le->entry.range.type = access_chars[REC_ACCESS_TYPE(tag)];
+		if ((p = decode_address(st, p, end,
+					&le->entry.range.base)) == NULL)
+			return NULL;
+		GET_SVARINT(p, end, &le->entry.range.stride);
+		GET_VARINT(p, end, &le->entry.range.count);
+		GET_VARINT(p, end, &u);
+		le->entry.range.size = u;
+		GET_SVARINT(p, end, &s);
+		le->entry.range.file = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.range.line = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.range.col = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.range.typeId = s;
+		GET_SVARINT(p, end, &s);
+		le->entry.range.varId = s;
+		return decode_data_timestamp(st, p, end,
+					     &le->entry.range.rg_timestamp);
+
+	case REC_THREAD_START:
+	case REC_THREAD_END:
+		le->entry_type = LOG_THREAD;
+		le->entry.thread.thread_id = st->thread_id;
+		le->entry.thread.thread_event_type =
+			REC_KIND(tag) == REC_THREAD_START ? THREAD_START :
+			THREAD_END;
+		return decode_timestamp(st, p, end,
+					&le->entry.thread.th_timestamp);
+
+	default:
+		return NULL;
+	}
+}
+
+static void
+print_record(logentry *le) {
+
+	accesslog *acl = &le->entry.access;
+	alloclog *all = &le->entry.alloc;
+	fnlog *fnl = &le->entry.fn;
+	threadlog *thl = &le->entry.thread;
+	rangelog *rgl = &le->entry.range;
+
+	switch (le->entry_type) {
+	case LOG_FN:
+		printf("%s %" PRId64 " %d %" PRIu64 "\n",
+		       fnl->fn_event_type == FN_BEGIN ? "fb" : "fe",
+		       fnl->function_id, fnl->thread_id, fnl->fn_timestamp);
+		break;
+	case LOG_THREAD:
+		printf("%s %d %" PRIu64 "\n",
+		       thl->thread_event_type == THREAD_START ? "tb" : "te",
+		       thl->thread_id, thl->th_timestamp);
+		break;
+	case LOG_ALLOC:
+		printf("alloc %p %" PRIu64 " %" PRIu64 " %" PRId64 " %" PRId64
+		       " %d %d %d %" PRIu64 "\n", all->addr, all->size,
+		       all->num, all->type, all->file,
+		       (int16_t)all->line, (int16_t)all->col,
+		       all->thread_id, all->al_timestamp);
+		break;
+	case LOG_ACCESS:
+		printf("%p ", acl->ptr);
+		switch (acl->value_type) {
+		case I8:
+			printf("%" PRIu8, acl->value.i8);
+			break;
+		case I16:
+			printf("%" PRIu16, acl->value.i16);
+			break;
+		case I32:
+			printf("%" PRIu32, acl->value.i32);
+			break;
+		case I64:
+			printf("%" PRIu64, acl->value.i64);
+			break;
+		case F32:
+			printf("%f", acl->value.f32);
+			break;
+		case F64:
+			printf("%lf", acl->value.f64);
+			break;
+		default:
+			printf("%p", acl->value.ptr);
+			break;
+		}
+		printf(" %c %" PRId64 " %d %d %" PRId64 " %" PRId64 " %d %"
+		       PRIu64 "\n", acl->type, acl->file, (int16_t)acl->line,
+		       (int16_t)acl->col, acl->typeId, acl->varId,
+		       acl->thread_id,
+		       acl->ac_timestamp);
+		break;
+	case LOG_RANGE:
+		printf("range %p %" PRId64 " %" PRIu64 " %" PRIu32 " %c %"
+		       PRId64 " %d %d %" PRId64 " %" PRId64 " %d %" PRIu64
+		       "\n", rgl->base, rgl->stride, rgl->count, rgl->size,
+		       rgl->type, rgl->file, (int16_t)rgl->line,
+		       (int16_t)rgl->col, rgl->typeId, rgl->varId,
+		       rgl->thread_id,
+		       rgl->rg_timestamp);
+		break;
+	}
+}
+
+static bool
+decode_block(decode_state *st, const uint8_t *p, const uint8_t *end,
+	     uint32_t nrecords) {
+
+	logentry le;
+
+	while (nrecords-- > 0) {
+		if ((p = decode_record(st, p, end, &le)) == NULL)
+			return false;
+		print_record(&le);
+		st->seq++;
+	}
+	return p == end;
+}
+
+static bool verbose = false;
+
+static int
+read_trace(const char *fname) {
+
+	FILE *in;
+	dinamite_file_header hdr;
+	dinamite_block_header bhdr;
+	decode_state st;
+	uint8_t *data = NULL, *raw = NULL, *records;
+	long block_offset;
+	size_t data_size = 0, raw_capacity = 0, size, used;
+	long raw_size;
+	int ret = -1;
+
+	if ((in = fopen(fname, "rb")) == NULL) {
+		fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    hdr.magic != DINAMITE_TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a DINAMITE binary trace\n", fname);
+		goto out;
+	}
+	if (hdr.version != DINAMITE_TRACE_VERSION) {
+		fprintf(stderr, "%s: unsupported trace version %d\n", fname,
+			hdr.version);
+		goto out;
+	}
+	if (fseek(in, hdr.header_size, SEEK_SET) != 0)
+		goto out;
+
+	if (verbose)
+		fprintf(stderr, "%s: thread %d, OS tid %d, clock %s, "
+			"%s timestamps\n", fname, hdr.thread_id, hdr.os_tid,
+			hdr.clock_source == DINAMITE_CLOCK_TSC ? "tsc" :
+			"monotonic",
+			hdr.ts_policy == TS_COARSE ? "coarse" : "delta");
+
+	memset(&st, 0, sizeof(st));
+	st.thread_id = hdr.thread_id;
+	st.coarse = hdr.ts_policy == TS_COARSE;
+
+	while (fread(&bhdr, sizeof(bhdr), 1, in) == 1) {
+		block_offset = ftell(in) - (long)sizeof(bhdr);
+		if (bhdr.magic == 0)
+			break;
+		if (bhdr.magic != DINAMITE_BLOCK_MAGIC) {
+			fprintf(stderr, "%s: bad block header at offset %ld\n",
+				fname, block_offset);
+			goto out;
+		}
+		if (bhdr.size > data_size) {
+			free(data);
+			data_size = bhdr.size;
+			if ((data = malloc(data_size)) == NULL) {
+				fprintf(stderr, "%s: %s\n", fname,
+					strerror(errno));
+				goto out;
+			}
+		}
+		size = fread(data, 1, bhdr.size, in);
+		if (size != bhdr.size && !(bhdr.flags & BLOCK_OPEN)) {
+			fprintf(stderr, "%s: truncated block\n", fname);
+			goto out;
+		}
+		st.clock.tick_base = bhdr.tick_base;
+		st.clock.ns_base = bhdr.ns_base;
+		st.clock.mult = bhdr.mult;
+		records = data;
+		if (bhdr.codec == BLOCK_LZ) {
+			if (bhdr.raw_size > raw_capacity) {
+				free(raw);
+				raw_capacity = bhdr.raw_size;
+				if ((raw = malloc(raw_capacity)) == NULL) {
+					fprintf(stderr, "%s: %s\n", fname,
+						strerror(errno));
+					goto out;
+				}
+			}
+			raw_size = dinamite_lz_decompress(data, size, raw,
+							  bhdr.raw_size);
+			if (raw_size != (long)bhdr.raw_size) {
+				fprintf(stderr, "%s: corrupt compressed "
+					"block\n", fname);
+				goto out;
+			}
+			records = raw;
+			size = raw_size;
+		} else if (bhdr.codec != BLOCK_RAW) {
+			fprintf(stderr, "%s: unknown block codec %u\n", fname,
+				bhdr.codec);
+			goto out;
+		}
+		if (!(bhdr.flags & BLOCK_CONTINUED)) {
+			st.prev_ts = bhdr.ts_base;
+			st.prev_ptr = 0;
+		}
+		if (bhdr.flags & BLOCK_OPEN) {
+			/* Only the committed records can be trusted */
+			used = DINAMITE_FILL_USED(bhdr.fill);
+			if (used > size) {
+				fprintf(stderr, "%s: truncated block\n", fname);
+				goto out;
+			}
+			if (!decode_block(&st, records, records + used,
+					  DINAMITE_FILL_RECORDS(bhdr.fill))) {
+				fprintf(stderr, "%s: corrupt block\n", fname);
+				goto out;
+			}
+			if (used < size && records[used] != REC_INVALID)
+				fprintf(stderr, "%s: dropping a record that was "
+					"not committed, at offset %ld\n", fname,
+					block_offset + (long)sizeof(bhdr) +
+					(long)used);
+		} else if (!decode_block(&st, records, records + size,
+					 bhdr.nrecords)) {
+			fprintf(stderr, "%s: corrupt block\n", fname);
+			goto out;
+		}
+		if (bhdr.padding > 0 && fseek(in, bhdr.padding, SEEK_CUR) != 0)
+			break;
+	}
+	ret = 0;
+out:
+	free(raw);
+	free(data);
+	fclose(in);
+	return ret;
+}
+
+int
+main(int argc, char **argv) {
+
+	int i, opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "rv")) != -1) {
+		switch (opt) {
+		case 'r':
+			raw_ticks = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= argc)
+		goto usage;
+
+	for (i = optind; i < argc; i++)
+		if (read_trace(argv[i]) != 0)
+			ret = 1;
+	return ret;
+
+usage:
+	fprintf(stderr, "Usage: %s [-r] [-v] trace.bin.<tid> ...\n", argv[0]);
+	return 1;
+}
@@ -1,6 +1,12 @@
+#include <pthread.h>
+#include <stdio.h>
 #include <time.h>
 #include "dinamite_time.h"
 
+#ifdef DINAMITE_HAVE_TSC
+#include <cpuid.h>
+#endif
+
 #define NS_IN_SECOND 1000000000
 
 #ifdef __MACH__
@@ -30,3 +36,134 @@ dinamite_time_nanoseconds(void) {
 	else
 		return 0;
 }
+
+int dinamite_clock_source = DINAMITE_CLOCK_MONOTONIC;
+
+static dinamite_clock_calibration calibration = {
+	0, 0, 1ULL << DINAMITE_CLOCK_SHIFT
+};
+static pthread_mutex_t calibration_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef DINAMITE_HAVE_TSC
+
+/* Time the first calibration over this many nanoseconds */
+#define CALIBRATION_NS 10000000
+
+/* First reference point, later calibrations measure from here */
+static uint64_t start_ticks, start_ns;
+
+static int
+dinamite_tsc_invariant(void) {
+
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) ||
+	    eax < 0x80000007)
+		return 0;
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return (edx >> 8) & 1;
+}
+
+/*
+ * Read the TSC and CLOCK_MONOTONIC as close together as we can: keep
+ * the sample for which the two TSC reads around clock_gettime() are the
+ * nearest.
+ */
+static void
+dinamite_clock_sample(uint64_t *ticks, uint64_t *ns) {
+
+	uint64_t before, after, now, best = 0;
+	unsigned int aux;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		before = __rdtscp(&aux);
+		now = dinamite_time_nanoseconds();
+		after = __rdtscp(&aux);
+		if (i == 0 || after - before < best) {
+			best = after - before;
+			*ticks = before + (after - before) / 2;
+			*ns = now;
+		}
+	}
+}
+
+static uint64_t
+dinamite_clock_mult(uint64_t ticks, uint64_t ns) {
+
+	if (ticks == 0)
+		return 1ULL << DINAMITE_CLOCK_SHIFT;
+	return (uint64_t)(((unsigned __int128)ns << DINAMITE_CLOCK_SHIFT) /
+			  ticks);
+}
+
+int
+dinamite_clock_init(int source) {
+
+	struct timespec pause = { 0, CALIBRATION_NS };
+	uint64_t ticks, ns;
+
+	if (source != DINAMITE_CLOCK_TSC)
+		return dinamite_clock_source;
+	if (!dinamite_tsc_invariant()) {
+		fprintf(stderr, "Warning: the TSC is not invariant on this "
+			"machine, using CLOCK_MONOTONIC\n");
+		return dinamite_clock_source;
+	}
+
+	dinamite_clock_sample(&start_ticks, &start_ns);
+	nanosleep(&pause, NULL);
+	dinamite_clock_sample(&ticks, &ns);
+
+	pthread_mutex_lock(&calibration_mtx);
+	calibration.tick_base = ticks;
+	calibration.ns_base = ns;
+	calibration.mult = dinamite_clock_mult(ticks - start_ticks,
+					       ns - start_ns);
+	pthread_mutex_unlock(&calibration_mtx);
+
+	dinamite_clock_source = DINAMITE_CLOCK_TSC;
+	return dinamite_clock_source;
+}
+
+void
+dinamite_clock_recalibrate(void) {
+
+	uint64_t ticks, ns;
+
+	if (dinamite_clock_source != DINAMITE_CLOCK_TSC)
+		return;
+
+	dinamite_clock_sample(&ticks, &ns);
+	pthread_mutex_lock(&calibration_mtx);
+	calibration.ns_base = dinamite_ticks_to_ns(&calibration, ticks);
+	calibration.tick_base = ticks;
+	calibration.mult = dinamite_clock_mult(ticks - start_ticks,
+					       ns - start_ns);
+	pthread_mutex_unlock(&calibration_mtx);
+}
+
+#else
+
+int
+dinamite_clock_init(int source) {
+
+	if (source == DINAMITE_CLOCK_TSC)
+		fprintf(stderr, "Warning: no TSC on this machine, "
+			"using CLOCK_MONOTONIC\n");
+	return dinamite_clock_source;
+}
+
+void
+dinamite_clock_recalibrate(void) {
+}
+
+#endif
+
+void
+dinamite_clock_get_calibration(dinamite_clock_calibration *c) {
+
+	pthread_mutex_lock(&calibration_mtx);
+	*c = calibration;
+	pthread_mutex_unlock(&calibration_mtx);
+}
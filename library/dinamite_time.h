@@ -4,6 +4,69 @@
 #include <sys/types.h>
 #include <inttypes.h>
 
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#define DINAMITE_HAVE_TSC
+#endif
+
+/*
+ * Trace timestamps are taken from one of these clocks. With the TSC the
+ * trace holds raw cycle counts, which are turned into nanoseconds with
+ * the dinamite_clock_calibration stored in the trace.
+ */
+enum dinamite_clock_sources {
+	DINAMITE_CLOCK_MONOTONIC, DINAMITE_CLOCK_TSC
+};
+
+/*
+ * ns = ns_base + (ticks - tick_base) * mult / 2^DINAMITE_CLOCK_SHIFT
+ *
+ * For CLOCK_MONOTONIC the ticks already are nanoseconds and the
+ * calibration is the identity.
+ */
+typedef struct _dinamite_clock_calibration {
+	uint64_t tick_base;
+	uint64_t ns_base;
+	uint64_t mult;
+} dinamite_clock_calibration;
+
+#define DINAMITE_CLOCK_SHIFT 32
+
+extern int dinamite_clock_source;
+
 uint64_t dinamite_time_nanoseconds(void);
 
+/*
+ * Select the clock used by dinamite_time_ticks(). Falls back to
+ * CLOCK_MONOTONIC, with a warning, when the TSC is requested but is not
+ * invariant. Returns the clock actually in use.
+ */
+int dinamite_clock_init(int source);
+
+/*
+ * Refine the TSC calibration against CLOCK_MONOTONIC. The conversion
+ * stays continuous: only the rate changes from now on.
+ */
+void dinamite_clock_recalibrate(void);
+void dinamite_clock_get_calibration(dinamite_clock_calibration *c);
+
+static inline uint64_t
+dinamite_time_ticks(void) {
+
+#ifdef DINAMITE_HAVE_TSC
+	if (dinamite_clock_source == DINAMITE_CLOCK_TSC)
+		return __rdtsc();
+#endif
+	return dinamite_time_nanoseconds();
+}
+
+static inline uint64_t
+dinamite_ticks_to_ns(const dinamite_clock_calibration *c, uint64_t ticks) {
+
+	__int128 delta = (int64_t)(ticks - c->tick_base);
+
+	return c->ns_base +
+		(uint64_t)((delta * c->mult) >> DINAMITE_CLOCK_SHIFT);
+}
+
 #endif
@@ -0,0 +1,54 @@
+#ifndef _DINAMITE_URING_H
+#define _DINAMITE_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Just enough of io_uring, through the raw system calls, to queue file
+ * writes and collect their completions from a single thread.
+ */
+typedef struct _dinamite_uring {
+	int fd;
+	unsigned int entries;
+	unsigned int pending;       /* queued but not submitted */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+} dinamite_uring;
+
+/* Returns 0, or -1 with errno set if io_uring is not available. */
+int dinamite_uring_init(dinamite_uring *r, unsigned int entries);
+void dinamite_uring_exit(dinamite_uring *r);
+
+/*
+ * Queue a write of len bytes at off. Returns -1 if the submission queue
+ * is full: submit and reap completions before trying again.
+ */
+int dinamite_uring_write(dinamite_uring *r, int fd, const void *buf,
+			 size_t len, off_t off, void *data);
+
+/* Hand the queued writes to the kernel. */
+int dinamite_uring_submit(dinamite_uring *r);
+
+/*
+ * Take one completion: the data given to dinamite_uring_write() and the
+ * result of the write (bytes written or -errno). Returns false if there
+ * is none, after waiting for one if wait is set.
+ */
+bool dinamite_uring_reap(dinamite_uring *r, bool wait, void **data,
+			 int *res);
+
+#endif
@@ -5,53 +5,60 @@
 #include <stdio.h>
 
 
-void logInit(int functionId) {
+void logInit(int64_t functionId) {
 }
 
-void logExit(int functionId) {
+void logExit(int64_t functionId) {
 }
 
-void logFnBegin(int functionId) {
+void logFnBegin(int64_t functionId) {
 }
 
-void logFnEnd(int functionId) {
+void logFnEnd(int64_t functionId) {
 }
 
-void logAlloc(void *addr, uint64_t size, uint64_t num, int type, int file, int line, int col) {
+void logAlloc(void *addr, uint64_t size, uint64_t num, int64_t type, int64_t file, int line, int col) {
 }
 
-void logAccessPtr(void *ptr, void *value, int type, int file, int line, int col, int typeId, int varId) {
+void logAccessPtr(void *ptr, void *value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
 }
 
-void logAccessStaticString(void *ptr, void *value, int type, int file, int line, int col, int typeId, int varId) {
+void logAccessStaticString(void *ptr, void *value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
 }
 
-void logAccessI8(void *ptr, uint8_t value, int type, int file, int line, int col, int typeId, int varId) {
+void logAccessI8(void *ptr, uint8_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
 }
 
-void logAccessI16(void *ptr, uint16_t value, int type, int file, int line, int col, int typeId, int varId) {
+void logAccessI16(void *ptr, uint16_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
 }
 
-void logAccessI32(void *ptr, uint32_t value, int type, int file, int line, int col, int typeId, int varId) {
+void logAccessI32(void *ptr, uint32_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
 }
 
-void logAccessI64(void *ptr, uint64_t value, int type, int file, int line, int col, int typeId, int varId) {
+void logAccessI64(void *ptr, uint64_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+}
+
+void logAccessRange(void *base, int64_t stride, uint64_t count, int size, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+}
+
+int logSampleCheck(void) {
+    return 1;
 }
 
 /* =============================
  These don't exist: */
 
-void logAccessF8(void *ptr, uint8_t value, int type, int file, int line, int col, int typeId, int varId) {
+void logAccessF8(void *ptr, uint8_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
 }
 
-void logAccessF16(void *ptr, uint16_t value, int type, int file, int line, int col, int typeId, int varId) {
+void logAccessF16(void *ptr, uint16_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
 }
 
 /* ============================= */
 
-void logAccessF32(void *ptr, float value, int type, int file, int line, int col, int typeId, int varId) {
+void logAccessF32(void *ptr, float value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
 }
 
-void logAccessF64(void *ptr, double value, int type, int file, int line, int col, int typeId, int varId) {
+void logAccessF64(void *ptr, double value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
 }
 #endif
@@ -0,0 +1,90 @@
+/*
+ * Microbenchmark for the per-event cost of the runtime probes. Calls the
+ * probes directly, the way instrumented code would, from several threads
+ * and reports the average cost of one event.
+ *
+ * Usage: probe_bench [threads] [events per thread]
+ *
+ * Build against the binary runtime with "make binary bench" and run with
+ * DINAMITE_TRACE_PREFIX pointing to a scratch directory.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dinamite_time.h"
+
+void logInit(int64_t functionId);
+void logExit(int64_t functionId);
+void logFnBegin(int64_t functionId);
+void logFnEnd(int64_t functionId);
+void logAccessI64(void *ptr, uint64_t value, int type, int64_t file, int line,
+		  int col, int64_t typeId, int64_t varId);
+
+static long nevents = 1000000;
+
+static void *
+bench_thread(void *arg) {
+
+	uint64_t *elapsed = (uint64_t *)arg;
+	uint64_t start, v = 0;
+	long i;
+
+	/* Let the runtime set up the thread before we start timing */
+	logFnBegin(0);
+	logFnEnd(0);
+
+	start = dinamite_time_nanoseconds();
+	for (i = 0; i < nevents; i += 4) {
+		logFnBegin(1);
+		logAccessI64(&v, v, 'r', 1, 10, 5, 2, 3);
+		v++;
+		logAccessI64(&v, v, 'w', 1, 10, 5, 2, 3);
+		logFnEnd(1);
+	}
+	*elapsed = dinamite_time_nanoseconds() - start;
+	return NULL;
+}
+
+int
+main(int argc, char **argv) {
+
+	int i, ret, nthreads = 4;
+	pthread_t *threads;
+	uint64_t *elapsed, total = 0;
+
+	if (argc > 1)
+		nthreads = atoi(argv[1]);
+	if (argc > 2)
+		nevents = atol(argv[2]);
+
+	threads = calloc(nthreads, sizeof(pthread_t));
+	elapsed = calloc(nthreads, sizeof(uint64_t));
+	if (threads == NULL || elapsed == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	logInit(0);
+	for (i = 0; i < nthreads; i++) {
+		ret = pthread_create(&threads[i], NULL, bench_thread,
+				     &elapsed[i]);
+		if (ret) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			return 1;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		total += elapsed[i];
+	}
+	logExit(0);
+
+	printf("%d threads, %ld events per thread: %.2f ns per event\n",
+	       nthreads, nevents, (double)total / nthreads / nevents);
+	return 0;
+}
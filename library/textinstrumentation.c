@@ -1,6 +1,7 @@
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -11,11 +12,11 @@ const char *filename = "access.trace";
 static FILE *out = NULL;
 
 #define OPEN_LOG() if (unlikely(out == NULL)) { printf("Opening log file %s...\n", filename); out = fopen(filename,"w"); }
-void logInit(int functionId) {
+void logInit(int64_t functionId) {
     OPEN_LOG();
 }
 
-void logExit(int functionId) {
+void logExit(int64_t functionId) {
     if (out != NULL) {
         printf("Closing log file %s...\n", filename);
         fclose(out);
@@ -23,75 +24,85 @@ void logExit(int functionId) {
     }
 }
 
-void logFnBegin(int functionId) {
-    fprintf(out, "fb %d\n", functionId);
+void logFnBegin(int64_t functionId) {
+    fprintf(out, "fb %" PRId64 "\n", functionId);
     fflush(out);
 }
 
-void logFnEnd(int functionId) {
-    fprintf(out, "fe %d\n", functionId);
+void logFnEnd(int64_t functionId) {
+    fprintf(out, "fe %" PRId64 "\n", functionId);
     fflush(out);
 }
 
-void logAlloc(void *addr, uint64_t size, uint64_t num, int type, int file, int line, int col) {
-    fprintf(out, "%p %llu %llu %d %d %d %d\n", addr, size, num, type, file, line, col);
+void logAlloc(void *addr, uint64_t size, uint64_t num, int64_t type, int64_t file, int line, int col) {
+    fprintf(out, "%p %" PRIu64 " %" PRIu64 " %" PRId64 " %" PRId64 " %d %d\n", addr, size, num, type, file, line, col);
     fflush(out);
 }
 
-void logAccessPtr(void *ptr, void *value, int type, int file, int line, int col, int typeId, int varId) {
-	fprintf(out, "%p %p %c %d %d %d %d %d\n", ptr, value, type, file, line, col, typeId, varId);
+void logAccessPtr(void *ptr, void *value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "%p %p %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", ptr, value, type, file, line, col, typeId, varId);
     fflush(out);
 
 	/*fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr,[> value, <]type, file, line, col, typeId, varId);*/
 }
 
-void logAccessStaticString(void *ptr, void *value, int type, int file, int line, int col, int typeId, int varId) {
-	fprintf(out, "%p %s %c %d %d %d %d %d\n", (char*)ptr, value, type, file, line, col, typeId, varId);
+void logAccessStaticString(void *ptr, void *value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "%p %s %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", (char*)ptr, (char*)value, type, file, line, col, typeId, varId);
     fflush(out);
 
 	/*fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr,[> value, <]type, file, line, col, typeId, varId);*/
 }
 
-void logAccessI8(void *ptr, uint8_t value, int type, int file, int line, int col, int typeId, int varId) {
-	fprintf(out, "%p %u %c %d %d %d %d %d\n", ptr, value, type, file, line, col, typeId, varId);
+void logAccessI8(void *ptr, uint8_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "%p %u %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", ptr, value, type, file, line, col, typeId, varId);
     fflush(out);
 
 	/*fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr,[> value, <]type, file, line, col, typeId, varId);*/
 }
 
-void logAccessI16(void *ptr, uint16_t value, int type, int file, int line, int col, int typeId, int varId) {
-	fprintf(out, "%p %hu %c %d %d %d %d %d\n", ptr, value, type, file, line, col, typeId, varId);
+void logAccessI16(void *ptr, uint16_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "%p %hu %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", ptr, value, type, file, line, col, typeId, varId);
     fflush(out);
 
 	/*fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr,[> value, <]type, file, line, col, typeId, varId);*/
 }
 
-void logAccessI32(void *ptr, uint32_t value, int type, int file, int line, int col, int typeId, int varId) {
-	fprintf(out, "%p %u %c %d %d %d %d %d\n", ptr, value, type, file, line, col, typeId, varId);
+void logAccessI32(void *ptr, uint32_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "%p %u %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", ptr, value, type, file, line, col, typeId, varId);
     fflush(out);
 
 	/*fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr,[> value, <]type, file, line, col, typeId, varId);*/
 }
 
-void logAccessI64(void *ptr, uint64_t value, int type, int file, int line, int col, int typeId, int varId) {
-	fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr, value, type, file, line, col, typeId, varId);
+void logAccessI64(void *ptr, uint64_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "%p %" PRIu64 " %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", ptr, value, type, file, line, col, typeId, varId);
     fflush(out);
 
 	/*fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr,[> value, <]type, file, line, col, typeId, varId);*/
 }
 
+void logAccessRange(void *base, int64_t stride, uint64_t count, int size, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "range %p %" PRId64 " %" PRIu64 " %d %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", base, stride, count, size, type, file, line, col, typeId, varId);
+    fflush(out);
+}
+
+/* Functions compiled for sampling always run instrumented */
+int logSampleCheck(void) {
+    return 1;
+}
+
 /* =============================
  These don't exist: */
 
-void logAccessF8(void *ptr, uint8_t value, int type, int file, int line, int col, int typeId, int varId) {
-	fprintf(out, "%p %c %c %d %d %d %d %d\n", ptr, value, type, file, line, col, typeId, varId);
+void logAccessF8(void *ptr, uint8_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "%p %c %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", ptr, value, type, file, line, col, typeId, varId);
     fflush(out);
 
 	/*fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr,[> value, <]type, file, line, col, typeId, varId);*/
 }
 
-void logAccessF16(void *ptr, uint16_t value, int type, int file, int line, int col, int typeId, int varId) {
-	fprintf(out, "%p %hu %c %d %d %d %d %d\n", ptr, value, type, file, line, col, typeId, varId);
+void logAccessF16(void *ptr, uint16_t value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "%p %hu %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", ptr, value, type, file, line, col, typeId, varId);
     fflush(out);
 
 	/*fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr,[> value, <]type, file, line, col, typeId, varId);*/
@@ -99,15 +110,15 @@ void logAccessF16(void *ptr, uint16_t value, int type, int file, int line, int c
 
 /* ============================= */
 
-void logAccessF32(void *ptr, float value, int type, int file, int line, int col, int typeId, int varId) {
-	fprintf(out, "%p %f %c %d %d %d %d %d\n", ptr, value, type, file, line, col, typeId, varId);
+void logAccessF32(void *ptr, float value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "%p %f %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", ptr, value, type, file, line, col, typeId, varId);
     fflush(out);
 
 	/*fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr,[> value, <]type, file, line, col, typeId, varId);*/
 }
 
-void logAccessF64(void *ptr, double value, int type, int file, int line, int col, int typeId, int varId) {
-	fprintf(out, "%p %lf %c %d %d %d %d %d\n", ptr, value, type, file, line, col, typeId, varId);
+void logAccessF64(void *ptr, double value, int type, int64_t file, int line, int col, int64_t typeId, int64_t varId) {
+	fprintf(out, "%p %lf %c %" PRId64 " %d %d %" PRId64 " %" PRId64 "\n", ptr, value, type, file, line, col, typeId, varId);
     fflush(out);
 
 	/*fprintf(out, "%p %llu %c %d %d %d %d %d\n", ptr,[> value, <]type, file, line, col, typeId, varId);*/
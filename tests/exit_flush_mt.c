@@ -0,0 +1,143 @@
+/*
+ * logExit() while other threads are still logging: every flush writes
+ * out the partly filled buffers of the running threads, and each block
+ * must hold exactly the records its header counts.
+ *
+ * Links against the binary runtime directly:
+ *
+ *	gcc -I../library -o exit_flush_mt exit_flush_mt.c -L../library \
+ *		-linstrumentation -lpthread
+ *	./exit_flush_mt && ../library/dinamite-reader trace.bin.* > /dev/null
+ *
+ * The reader must not report a corrupt block. Run it a few times, also
+ * with DINAMITE_TIMESTAMPS=coarse and DINAMITE_OUTPUT=mmap or direct.
+ *
+ * With DINAMITE_OUTPUT=mmap the traced process exits normally with its
+ * main thread still traced, and the program then checks that every
+ * trace was sealed: no block is left open and each file ends right
+ * after the records of its last block. It exits with status 1 if not.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "binaryinstrumentation.h"
+
+#define NTHREADS 4
+#define NFLUSHES 50
+#define MAX_ITERATIONS 2000000
+
+void logInit(int64_t functionId);
+void logExit(int64_t functionId);
+void logFnBegin(int64_t functionId);
+void logFnEnd(int64_t functionId);
+void logAccessI32(void *ptr, uint32_t value, int type, int64_t file, int line,
+		  int col, int64_t typeId, int64_t varId);
+
+static volatile int stop = 0;
+
+static void *
+work(void *arg) {
+
+	int x = 0;
+	long i;
+
+	for (i = 0; !stop && i < MAX_ITERATIONS; i++) {
+		logFnBegin(i % 50);
+		logAccessI32(&x, i, 'w', 1, i % 1000, 3, 4, 5);
+		logFnEnd(i % 50);
+	}
+	return NULL;
+}
+
+/* Whether a trace written in mmap mode was sealed at exit */
+static int
+check_sealed(const char *fname) {
+
+	dinamite_file_header hdr;
+	dinamite_block_header bhdr;
+	long end = -1;
+	struct stat st;
+	FILE *f;
+	int ret = 0;
+
+	if ((f = fopen(fname, "rb")) == NULL || fstat(fileno(f), &st) != 0 ||
+	    fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fseek(f, hdr.header_size, SEEK_SET) != 0) {
+		fprintf(stderr, "%s: cannot read the trace\n", fname);
+		return 1;
+	}
+	while (fread(&bhdr, sizeof(bhdr), 1, f) == 1 &&
+	       bhdr.magic == DINAMITE_BLOCK_MAGIC) {
+		if (bhdr.flags & BLOCK_OPEN) {
+			fprintf(stderr, "%s: block at offset %ld left open\n",
+				fname, ftell(f) - (long)sizeof(bhdr));
+			ret = 1;
+		}
+		end = ftell(f) + bhdr.size;
+		if (fseek(f, bhdr.size + bhdr.padding, SEEK_CUR) != 0)
+			break;
+	}
+	if (end != st.st_size) {
+		fprintf(stderr, "%s: %ld bytes, but its last block ends at "
+			"%ld\n", fname, (long)st.st_size, end);
+		ret = 1;
+	}
+	fclose(f);
+	return ret;
+}
+
+static void
+trace(void) {
+
+	pthread_t threads[NTHREADS];
+	int i;
+
+	logInit(0);
+	logFnBegin(0);
+	for (i = 0; i < NTHREADS; i++)
+		pthread_create(&threads[i], NULL, work, NULL);
+	for (i = 0; i < NFLUSHES; i++) {
+		usleep(500);
+		logExit(0);
+	}
+	stop = 1;
+	for (i = 0; i < NTHREADS; i++)
+		pthread_join(threads[i], NULL);
+	logFnEnd(0);
+	logExit(0);
+}
+
+int
+main(int argc, char **argv) {
+
+	const char *output = getenv("DINAMITE_OUTPUT");
+	char fname[32];
+	int i, status, ret = 0;
+	pid_t pid;
+
+	/* Trace in a child, so that its exit can be checked from here */
+	if ((pid = fork()) == 0) {
+		trace();
+		exit(0);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "The traced process failed\n");
+		return 1;
+	}
+
+	if (output == NULL || strcmp(output, "mmap") != 0)
+		return 0;
+	for (i = 0; i <= NTHREADS; i++) {
+		snprintf(fname, sizeof(fname), "trace.bin.%d", i);
+		ret |= check_sealed(fname);
+	}
+	return ret;
+}
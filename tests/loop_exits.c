@@ -0,0 +1,56 @@
+/*
+ * Loops for DIN_ACCESS_RANGES=1. Only the accesses of single_exit() may
+ * become range events; every access of the other loops must still be
+ * logged in every iteration, so each array element shows up in the
+ * trace.
+ */
+
+#include <stdio.h>
+
+#define N 64
+
+int a[N], b[N], c[N];
+
+/* One exit edge, into a block of its own: one range event per array */
+void single_exit(int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        a[i] = i;
+        b[i] = a[i] + 1;
+    }
+}
+
+/* The break is a second exit: no ranges */
+int multi_exit(int n, int stop) {
+    int i, sum = 0;
+
+    for (i = 0; i < n; i++) {
+        if (c[i] == stop)
+            break;
+        sum += b[i];
+        c[i] = sum;
+    }
+    return sum;
+}
+
+/* The exit block is also reached without going through the loop */
+int shared_exit(int n, int skip) {
+    int i, sum = 0;
+
+    if (skip)
+        goto out;
+    for (i = 0; i < n; i++)
+        sum += a[i];
+out:
+    return sum;
+}
+
+int main(int argc, char **argv) {
+    single_exit(N);
+    printf("%d\n", multi_exit(N, -1));
+    printf("%d\n", multi_exit(N, c[N / 2]));
+    printf("%d\n", shared_exit(N, 0));
+    printf("%d\n", shared_exit(N, argc > 1));
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * A mapped trace whose process died in the middle of a record: the
+ * record it had started is left in the window, followed by the zeros of
+ * the rest of the file. The reader must print the records committed
+ * before it and nothing of the torn one.
+ *
+ * Links against the binary runtime directly:
+ *
+ *	gcc -I../library -o torn_window torn_window.c -L../library \
+ *		-linstrumentation
+ *	DINAMITE_OUTPUT=mmap ./torn_window
+ *	../library/dinamite-reader trace.bin.0
+ *
+ * The program logs NRECORDS function events, starts another one without
+ * committing it and aborts. The reader must print NRECORDS + 1 lines,
+ * the thread's begin event and the function events, warn once about the
+ * record that was not committed and exit with status 0.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binaryinstrumentation_probes.h"
+
+#define NRECORDS 1000
+
+/* Wide enough that its varint is cut short, with more bytes to come */
+#define FUNCTION_ID 0x12345678
+
+void logInit(int64_t functionId);
+void logFnBegin(int64_t functionId);
+void logFnEnd(int64_t functionId);
+
+int
+main(int argc, char **argv) {
+
+	uint8_t record[DINAMITE_MAX_RECORD], *p;
+	int i;
+
+	logInit(0);
+	for (i = 0; i < NRECORDS / 2; i++) {
+		logFnBegin(FUNCTION_ID);
+		logFnEnd(FUNCTION_ID);
+	}
+
+	/*
+	 * Die after the tag and the first two bytes of the function ID,
+	 * as a thread would if it crashed while encoding the record. A
+	 * zero byte would end the varint, so the bytes the record never
+	 * got still decode as something.
+	 */
+	record[0] = REC_TAG(REC_FN_BEGIN, 0, 0);
+	dinamite_put_svarint(record + 1, FUNCTION_ID);
+	if ((p = __dinamite_reserve()) != NULL)
+		memcpy(p, record, 3);
+	abort();
+}